@@ -2,15 +2,25 @@
 
 #include "bitmap.h"
 #include <stdlib.h>
-#include <strings.h>    // for `ffs`
-
-/* constants */
-// how far to loop in array
-#define SIZE (NUM_BLOCKS/8) //128
+#include <string.h>
+#include <endian.h>
 
 /* globals */
-// the actual data. initialize all bits to high
-uint8_t free_bit_map[SIZE] = { [0 ... SIZE-1] = UINT8_MAX };
+// the actual data, a bit per block, set while the block is free. It is
+// stored byte by byte and scanned as 64-bit little endian words
+uint8_t *free_bit_map = NULL;
+static uint64_t *bitmap_words = NULL;
+// a summary of it: bit w is set while word w has a free block. No summary
+// word before summary_hint has a bit set, so allocation does not rescan the
+// full start of the disk
+static uint64_t *summary = NULL;
+static uint32_t summary_hint = 0;
+static uint32_t num_blocks = 0;
+static uint32_t num_words = 0;
+static uint32_t num_summary_words = 0;
+static uint32_t free_blocks = 0;
+static int (*load_hook)(void) = NULL;
+static void (*change_hook)(uint32_t byte) = NULL;
 
 /* macros */
 #define FREE_BIT(_data, _which_bit) \
@@ -19,43 +29,182 @@ uint8_t free_bit_map[SIZE] = { [0 ... SIZE-1] = UINT8_MAX };
 #define USE_BIT(_data, _which_bit) \
     _data = _data & ~(1 << _which_bit)
 
+// whether a block is free
+#define IS_FREE(_index) \
+    ((free_bit_map[(_index) / 8] & (1 << ((_index) % 8))) != 0)
+
+// the bitmap must be loaded before it is used
+static int ready() {
+    if (free_bit_map == NULL) { return -1; }
+    return load_hook == NULL ? 0 : load_hook();
+}
+
+// keep the summary bit of one bitmap word in step with it
+static void update_summary(uint32_t word) {
+    uint64_t bit = (uint64_t)1 << (word % 64);
+    if (bitmap_words[word] != 0) {
+        summary[word / 64] |= bit;
+        if (word / 64 < summary_hint) { summary_hint = word / 64; }
+    }
+    else {
+        summary[word / 64] &= ~bit;
+    }
+}
+
+int init_bitmap(uint32_t blocks) {
+    free(bitmap_words);
+    free(summary);
+    num_blocks = blocks;
+    num_words = (blocks + 63) / 64;
+    num_summary_words = (num_words + 63) / 64;
+    bitmap_words = calloc(num_words > 0 ? num_words : 1, sizeof(uint64_t));
+    summary = calloc(num_summary_words > 0 ? num_summary_words : 1, sizeof(uint64_t));
+    free_bit_map = (uint8_t *)bitmap_words;
+    if (bitmap_words == NULL || summary == NULL) {
+        free(bitmap_words);
+        free(summary);
+        bitmap_words = summary = NULL;
+        free_bit_map = NULL;
+        return -1;
+    }
+
+    // initialize all bits to high
+    memset(free_bit_map, UINT8_MAX, (blocks + 7) / 8);
+    rebuild_bitmap_summary();
+    return 0;
+}
+
+void set_bitmap_hooks(int (*load)(void), void (*changed)(uint32_t byte)) {
+    load_hook = load;
+    change_hook = changed;
+}
+
+void rebuild_bitmap_summary() {
+    // the padding past the last block, up to a whole word, is never free
+    for (uint32_t index = num_blocks; index < num_words * 64; index++) {
+        USE_BIT(free_bit_map[index / 8], index % 8);
+    }
+    memset(summary, 0, num_summary_words * sizeof(uint64_t));
+    free_blocks = 0;
+    for (uint32_t w = 0; w < num_words; w++) {
+        if (bitmap_words[w] != 0) {
+            summary[w / 64] |= (uint64_t)1 << (w % 64);
+            free_blocks += __builtin_popcountll(bitmap_words[w]);
+        }
+    }
+    summary_hint = 0;
+}
+
+uint32_t free_block_count() {
+    if (ready() < 0) { return 0; }
+    return free_blocks;
+}
+
 void force_set_index(uint32_t index) {
-    // Used to force indicies to used 
-    // this is the opposite of rm_index. 
+    // Used to force indicies to used
+    // this is the opposite of rm_index.
+    if (ready() < 0 || index >= num_blocks) { return; }
     uint32_t i = index / 8;
 
     // get which bit to set to used
     uint8_t bit = index % 8;
 
     // set bit to used
+    if ((free_bit_map[i] & (1 << bit)) != 0) { free_blocks--; }
     USE_BIT(free_bit_map[i], bit);
+    update_summary(i / 8);
+    if (change_hook != NULL) { change_hook(i); }
 }
 
 uint32_t get_index() {
-    uint32_t i = 0;
-
-    // find the first section with a free bit
-    // let's ignore overflow for now...
-    while (free_bit_map[i] == 0) { i++; }
-
-    // now, find the first free bit
-    /*
-        The ffs() function returns the position of the first (least
-       significant) bit set in the word i.  The least significant bit is
-       position 1 and the most significant position is, for example, 32 or
-       64.  
-    */
-    // Since ffs has the lsb as 1, not 0. So we need to subtract
-    uint8_t bit = ffs(free_bit_map[i]) - 1;
+    if (ready() < 0 || free_blocks == 0) { return BITMAP_FULL; }
+
+    // find the first word with a free bit through the summary; there is one at or past the hint
+    while (summary[summary_hint] == 0) { summary_hint++; }
+    uint32_t word = summary_hint * 64 + __builtin_ctzll(summary[summary_hint]);
+
+    // now, find the first free bit; the bitmap is stored byte by byte, so the word is read as little endian
+    uint32_t index = word * 64 + __builtin_ctzll(le64toh(bitmap_words[word]));
 
     // set the bit to used
-    USE_BIT(free_bit_map[i], bit);
+    force_set_index(index);
 
     //return which block we used
-    return i*8 + bit;
+    return index;
+}
+
+// first free block at or after index, BITMAP_FULL if there is none
+static uint32_t next_free(uint32_t index) {
+    if (index >= num_blocks) { return BITMAP_FULL; }
+    uint32_t w = index / 64;
+    uint64_t word = le64toh(bitmap_words[w]) & (UINT64_MAX << (index % 64));
+    if (word != 0) { return w * 64 + __builtin_ctzll(word); }
+
+    // the words after it are found through the summary
+    w++;
+    uint32_t s = w / 64;
+    if (s >= num_summary_words) { return BITMAP_FULL; }
+    uint64_t bits = summary[s] & (UINT64_MAX << (w % 64));
+    while (bits == 0) {
+        if (++s >= num_summary_words) { return BITMAP_FULL; }
+        bits = summary[s];
+    }
+    w = s * 64 + __builtin_ctzll(bits);
+    return w * 64 + __builtin_ctzll(le64toh(bitmap_words[w]));
+}
+
+// number of free blocks in a row from index, counting no further than max
+static uint32_t free_run_length(uint32_t index, uint32_t max) {
+    uint32_t length = 0;
+    while (length < max) {
+        uint32_t i = index + length;
+        if (i >= num_blocks) { break; }
+        uint32_t available = 64 - i % 64;
+        uint64_t inverted = ~(le64toh(bitmap_words[i / 64]) >> (i % 64));
+        uint32_t ones = inverted == 0 ? 64 : __builtin_ctzll(inverted);
+        length += ones < available ? ones : available;
+        if (ones < available) { break; }
+    }
+    return length < max ? length : max;
+}
+
+uint32_t get_extent(uint32_t goal, uint32_t n, uint32_t *len) {
+    *len = 0;
+    if (n == 0 || ready() < 0 || free_blocks == 0) { return BITMAP_FULL; }
+    if (goal >= num_blocks) { goal = 0; }
+
+    // walk the free runs from goal to the end, then from the start back to goal,
+    // stopping at the first run of n blocks and remembering the longest one seen
+    uint32_t best = BITMAP_FULL;
+    uint32_t bestLength = 0;
+    int wrapped = 0;
+    uint32_t index = next_free(goal);
+    while (1) {
+        if (index == BITMAP_FULL || (wrapped && index >= goal)) {
+            if (wrapped || goal == 0) { break; }
+            wrapped = 1;
+            index = next_free(0);
+            continue;
+        }
+        uint32_t run = free_run_length(index, n);
+        if (run > bestLength) {
+            best = index;
+            bestLength = run;
+        }
+        if (run == n) { break; }
+        index = next_free(index + run);
+    }
+
+    // set the run to used
+    for (uint32_t i = 0; i < bestLength; i++) {
+        force_set_index(best + i);
+    }
+    *len = bestLength;
+    return best;
 }
 
 void rm_index(uint32_t index) {
+    if (ready() < 0 || index >= num_blocks) { return; }
 
     // get index in array of which bit to free
     uint32_t i = index / 8;
@@ -64,6 +213,8 @@ void rm_index(uint32_t index) {
     uint8_t bit = index % 8;
 
     // free bit
+    if (!IS_FREE(index)) { free_blocks++; }
     FREE_BIT(free_bit_map[i], bit);
+    update_summary(i / 8);
+    if (change_hook != NULL) { change_hook(i); }
 }
-
@@ -3,12 +3,40 @@
 
 #include <stdint.h>
 
-#define NUM_BLOCKS 1024
+// returned by get_index and get_extent when no block is free
+#define BITMAP_FULL UINT32_MAX
+
+// the bitmap, one bit per block, set while the block is free
+extern uint8_t *free_bit_map;
+
+/*
+ * @short allocate the bitmap for a number of blocks, all of them free
+ * @return 0 on success, -1 if it could not be allocated
+ */
+int init_bitmap(uint32_t blocks);
+
+/*
+ * @short let the file system load the bitmap lazily and record changes
+ * @long load is called before every use of the bitmap and returns -1 if
+ *       it could not be loaded; it should be cheap once it has been.
+ *       changed is called with the byte of free_bit_map that changed.
+ *       Either may be NULL.
+ */
+void set_bitmap_hooks(int (*load)(void), void (*changed)(uint32_t byte));
+
+/*
+ * @short recount the free blocks after free_bit_map was filled in directly
+ */
+void rebuild_bitmap_summary();
+
+/*
+ * @short number of free blocks
+ */
+uint32_t free_block_count();
 
 /*
  * @short force an index to be set.
  * @long Use this to setup your superblock, inode table and free bit map
- *       This has been left unimplemented. You should fill it out.
  *
  * @param index index to set 
  *
@@ -17,10 +45,23 @@ void force_set_index(uint32_t index);
 
 /*
  * @short find the first free data block
- * @return index of data block to use
+ * @return index of data block to use, BITMAP_FULL if none is free
  */
 uint32_t get_index();
 
+/*
+ * @short find and take a run of contiguous free blocks
+ * @long The run starts at the first free block at or after goal, wrapping
+ *       around to the start of the disk, that has n free blocks in a row.
+ *       When no run is that long, the longest free run is taken instead.
+ *
+ * @param goal block the run should preferably start at or after
+ * @param n most blocks to take
+ * @param len set to the number of blocks taken, 0 if none are free
+ * @return first block of the run, BITMAP_FULL if none is free
+ */
+uint32_t get_extent(uint32_t goal, uint32_t n, uint32_t *len);
+
 /*
  * @short frees an index
  * @param index the index to free
@@ -0,0 +1,840 @@
+// block buffer cache between the file system and the disk emulator
+
+#include "block_cache.h"
+#include "disk_emu.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/* constants */
+// end of a list or hash chain
+#define NIL -1
+// readahead requests that may be in flight at once
+#define MAX_PREFETCH 16
+
+// lists an entry can be on
+enum {
+    LIST_FREE,          // resident entries holding no block
+    LIST_MAIN,          // LRU: every cached block, 2Q: Am, blocks used more than once
+    LIST_IN,            // 2Q: A1in, blocks seen once, in FIFO order
+    LIST_GHOST,         // 2Q: A1out, numbers of blocks recently dropped from A1in
+    LIST_GHOST_FREE,    // ghost entries holding no block number
+    NUM_LISTS
+};
+
+/* types */
+typedef struct cache_entry {
+    int block;      // disk block held, NIL while the entry is free
+    int list;       // list the entry is on
+    int prev, next; // position on that list, most recent first
+    int hnext;      // next entry in the same hash bucket
+    int dirty;      // newer than the copy on disk
+    int prefetched; // read ahead and not used yet
+    long long dirtied_ms;   // when the entry last went from clean to dirty
+    unsigned long long copied;  // when its data was last replaced, in writes
+} cache_entry;
+
+typedef struct cache_list {
+    int head, tail, count;
+} cache_list;
+
+// an asynchronous read of blocks that are not cached yet
+typedef struct prefetch_run {
+    int ticket;     // 0 while the slot is unused
+    int start, nblocks;
+    int stale;      // written or discarded while in flight, so the data is old
+    char *buffer;
+} prefetch_run;
+
+// a replacement policy decides where new blocks go, what a hit does and what to evict
+typedef struct cache_policy {
+    const char *name;
+    int (*admit)(int ghost_hit);    // list for a block just read or written
+    void (*hit)(int i);             // entry i was used again
+    int (*victim)();                // resident entry to evict
+    void (*evicted)(int i);         // entry i is about to lose its block
+} cache_policy;
+
+/* globals */
+// entries [0, capacity) hold data, [capacity, capacity + ghosts) only remember block numbers
+static cache_entry *entries = NULL;
+static char *data = NULL;       // one block of data per resident entry
+static int *buckets = NULL;
+static int num_buckets = 0;
+static int capacity = 0;
+static int ghosts = 0;
+static int in_target = 0;       // 2Q: A1in is trimmed to this size first
+static int block_size = 0;
+static cache_list lists[NUM_LISTS];
+static cache_stats_t stats;
+static int cache_policy_id = -1;
+static const cache_policy *policy;
+// everything above is guarded by cache_lock, which the flusher thread shares
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// write-back state
+static cache_writeback writeback;
+static int writeback_set = 0;
+static int num_dirty = 0;
+static int dirty_limit = 0;         // writers flush for themselves above this
+static int background_limit = 0;    // the flusher is woken above this
+static block_iovec *flush_vec = NULL;
+// a flush writes copies of the dirty blocks, so the lock is not held during the write
+static char *flush_data = NULL;
+static unsigned long long *flush_copied = NULL;
+static int flushing = 0;
+static pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER;
+static unsigned long long copies = 0;   // data copied into entries so far
+static pthread_t flusher;
+static int flusher_running = 0;
+static int flusher_stop = 0;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+
+// readahead state
+static prefetch_run prefetches[MAX_PREFETCH];
+static int num_unused = 0;          // read-ahead blocks cached but not used yet
+static int num_inflight = 0;        // blocks being read ahead
+
+/* macros */
+#define ENTRY_DATA(_i) (data + (size_t)(_i) * block_size)
+#define BUCKET(_block) ((unsigned int)(_block) & (num_buckets - 1))
+#define RESIDENT(_i) ((_i) != NIL && (_i) < capacity)
+#define WRITEBACK (writeback.dirty_ratio > 0)
+
+static long long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void list_remove(int i) {
+    cache_list *l = &lists[entries[i].list];
+
+    if (entries[i].prev != NIL) entries[entries[i].prev].next = entries[i].next;
+    else l->head = entries[i].next;
+    if (entries[i].next != NIL) entries[entries[i].next].prev = entries[i].prev;
+    else l->tail = entries[i].prev;
+    l->count--;
+}
+
+static void list_push(int list, int i) {
+    cache_list *l = &lists[list];
+
+    entries[i].list = list;
+    entries[i].prev = NIL;
+    entries[i].next = l->head;
+    if (l->head != NIL) entries[l->head].prev = i;
+    l->head = i;
+    if (l->tail == NIL) l->tail = i;
+    l->count++;
+}
+
+static void list_move(int list, int i) {
+    list_remove(i);
+    list_push(list, i);
+}
+
+// finds a resident or ghost entry for the block
+static int lookup(int block) {
+    int i = buckets[BUCKET(block)];
+
+    while (i != NIL && entries[i].block != block) {
+        i = entries[i].hnext;
+    }
+    return i;
+}
+
+static void hash_insert(int i, int block) {
+    entries[i].block = block;
+    entries[i].hnext = buckets[BUCKET(block)];
+    buckets[BUCKET(block)] = i;
+}
+
+static void hash_remove(int i) {
+    int *link = &buckets[BUCKET(entries[i].block)];
+
+    while (*link != i) {
+        link = &entries[*link].hnext;
+    }
+    *link = entries[i].hnext;
+    entries[i].block = NIL;
+}
+
+static void set_dirty(int i, int dirty) {
+    if (dirty && !entries[i].dirty) {
+        entries[i].dirtied_ms = now_ms();
+    }
+    num_dirty += dirty - entries[i].dirty;
+    entries[i].dirty = dirty;
+}
+
+static void set_prefetched(int i, int prefetched) {
+    num_unused += prefetched - entries[i].prefetched;
+    entries[i].prefetched = prefetched;
+}
+
+// drop an entry from the hash and put it back on its free list
+static void release(int i) {
+    if (RESIDENT(i)) {
+        set_dirty(i, 0);
+        set_prefetched(i, 0);
+    }
+    hash_remove(i);
+    list_move(RESIDENT(i) ? LIST_FREE : LIST_GHOST_FREE, i);
+}
+
+// remember that a block was recently cached, forgetting the oldest such block if needed
+static void ghost_add(int block) {
+    int g = lists[LIST_GHOST_FREE].tail;
+
+    if (ghosts == 0) {
+        return;
+    }
+    if (g == NIL) {
+        g = lists[LIST_GHOST].tail;
+        hash_remove(g);
+    }
+    hash_insert(g, block);
+    list_move(LIST_GHOST, g);
+}
+
+/* LRU: a single list in order of last use */
+static int lru_admit(int ghost_hit) {
+    return LIST_MAIN;
+}
+
+static void lru_hit(int i) {
+    list_move(LIST_MAIN, i);
+}
+
+static int lru_victim() {
+    return lists[LIST_MAIN].tail;
+}
+
+static void lru_evicted(int i) {
+}
+
+/* 2Q: blocks seen once wait in a FIFO; only a block used again, or read
+ * back soon after falling out of that FIFO, enters the LRU main list. A
+ * one-pass scan therefore cycles through A1in without touching Am.
+ */
+static int twoq_admit(int ghost_hit) {
+    return ghost_hit ? LIST_MAIN : LIST_IN;
+}
+
+static void twoq_hit(int i) {
+    // a second use inside A1in is still the same burst of accesses
+    if (entries[i].list == LIST_MAIN) {
+        list_move(LIST_MAIN, i);
+    }
+}
+
+static int twoq_victim() {
+    if (lists[LIST_IN].count > in_target || lists[LIST_MAIN].count == 0) {
+        return lists[LIST_IN].tail;
+    }
+    return lists[LIST_MAIN].tail;
+}
+
+static void twoq_evicted(int i) {
+    if (entries[i].list == LIST_IN) {
+        ghost_add(entries[i].block);
+    }
+}
+
+static const cache_policy policies[] = {
+    [CACHE_POLICY_LRU] = { "lru", lru_admit, lru_hit, lru_victim, lru_evicted },
+    [CACHE_POLICY_2Q] = { "2q", twoq_admit, twoq_hit, twoq_victim, twoq_evicted },
+};
+
+#define NUM_POLICIES ((int)(sizeof(policies) / sizeof(policies[0])))
+
+// an explicit set_cache_policy wins, then SFS_CACHE_POLICY ("lru" or "2q"), then LRU
+static const cache_policy *resolve_policy() {
+    char *env = getenv("SFS_CACHE_POLICY");
+
+    if (cache_policy_id >= 0 && cache_policy_id < NUM_POLICIES) {
+        return &policies[cache_policy_id];
+    }
+    for (int p = 0; env != NULL && p < NUM_POLICIES; p++) {
+        if (strcasecmp(env, policies[p].name) == 0) {
+            return &policies[p];
+        }
+    }
+    return &policies[CACHE_POLICY_LRU];
+}
+
+// an explicit set_cache_writeback wins, then SFS_CACHE_WRITEBACK, "on" or
+// key=value overrides such as "ratio=40,expire=1000", then write-through
+static void resolve_writeback() {
+    static const cache_writeback defaults = { 20, 10, 3000, 500 };
+    char *env, *copy, *tok, *save, *val;
+
+    if (writeback_set) {
+        return;
+    }
+    memset(&writeback, 0, sizeof(writeback));
+    env = getenv("SFS_CACHE_WRITEBACK");
+    if (env == NULL || strcasecmp(env, "off") == 0) {
+        return;
+    }
+
+    writeback = defaults;
+    copy = strdup(env);
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (val == NULL) continue;
+        *val++ = '\0';
+        if (strcmp(tok, "ratio") == 0) writeback.dirty_ratio = atoi(val);
+        else if (strcmp(tok, "background") == 0) writeback.background_ratio = atoi(val);
+        else if (strcmp(tok, "expire") == 0) writeback.expire_ms = atoi(val);
+        else if (strcmp(tok, "interval") == 0) writeback.interval_ms = atoi(val);
+    }
+    free(copy);
+}
+
+static int compare_iovec(const void *a, const void *b) {
+    int x = ((const block_iovec *)a)->block;
+    int y = ((const block_iovec *)b)->block;
+
+    return (x > y) - (x < y);
+}
+
+// write out dirty blocks, all of them or only those dirty since before
+// older_than, in block order so adjacent blocks go out as one request.
+// The lock is dropped for the write, so callers look at the cache afresh
+// after; the blocks stay dirty until the write is done, and one replaced
+// in the meantime stays dirty for the next flush
+static int flush_dirty(long long older_than) {
+    int n = 0, rc = 0, e, slot;
+
+    // one flush at a time, and whatever it wrote is clean by the time the next starts
+    while (flushing) {
+        pthread_cond_wait(&flush_done, &cache_lock);
+    }
+    for (int i = 0; i < capacity && n < num_dirty; i++) {
+        if (entries[i].dirty && (older_than == 0 || entries[i].dirtied_ms <= older_than)) {
+            memcpy(flush_data + (size_t)n * block_size, ENTRY_DATA(i), block_size);
+            flush_copied[n] = entries[i].copied;
+            flush_vec[n].block = entries[i].block;
+            flush_vec[n].buffer = flush_data + (size_t)n * block_size;
+            flush_vec[n].status = 0;
+            n++;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    flushing = 1;
+    pthread_mutex_unlock(&cache_lock);
+    qsort(flush_vec, n, sizeof(block_iovec), compare_iovec);
+    writev_blocks(flush_vec, n);
+    pthread_mutex_lock(&cache_lock);
+
+    // failed blocks stay dirty and are tried again later
+    for (int k = 0; k < n; k++) {
+        if (flush_vec[k].status > 0) {
+            slot = ((char *)flush_vec[k].buffer - flush_data) / block_size;
+            e = lookup(flush_vec[k].block);
+            if (RESIDENT(e) && entries[e].copied == flush_copied[slot]) {
+                set_dirty(e, 0);
+            }
+            stats.flushed++;
+        } else {
+            rc = -1;
+        }
+    }
+    stats.flushes++;
+    flushing = 0;
+    pthread_cond_broadcast(&flush_done);
+    return rc;
+}
+
+static void *flusher_main(void *arg) {
+    struct timespec until;
+
+    pthread_mutex_lock(&cache_lock);
+    while (!flusher_stop) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += writeback.interval_ms / 1000;
+        until.tv_nsec += (long)(writeback.interval_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&flusher_wake, &cache_lock, &until);
+        if (flusher_stop) {
+            break;
+        }
+        // past the background limit everything goes, otherwise only what has aged
+        if (num_dirty > background_limit) {
+            flush_dirty(0);
+        } else if (num_dirty > 0) {
+            flush_dirty(now_ms() - writeback.expire_ms);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+}
+
+// make sure claim finds a clean entry to evict if the cache is full; a dirty
+// victim is written out together with every other dirty block, with the lock
+// dropped. Returns -1 if the write failed or the victim was dirtied again
+static int make_room() {
+    if (lists[LIST_FREE].tail != NIL || !entries[policy->victim()].dirty) {
+        return 0;
+    }
+    if (flush_dirty(0) < 0) {
+        return -1;
+    }
+    return lists[LIST_FREE].tail != NIL || !entries[policy->victim()].dirty ? 0 : -1;
+}
+
+// find an entry for a block that is not cached, evicting one if the cache is
+// full; make_room must have left a clean victim
+static int claim(int block) {
+    int g = lookup(block);
+    int ghost_hit = g != NIL;
+    int i = lists[LIST_FREE].tail;
+
+    if (ghost_hit) {
+        stats.ghost_hits++;
+        release(g);
+    }
+    if (i == NIL) {
+        i = policy->victim();
+        policy->evicted(i);
+        hash_remove(i);
+        stats.evictions++;
+    }
+    hash_insert(i, block);
+    list_move(policy->admit(ghost_hit), i);
+    set_prefetched(i, 0);
+    return i;
+}
+
+// cache a copy of a block, replacing any older copy
+static int insert(int block, const char *src, int dirty) {
+    int i;
+
+    if (!RESIDENT(lookup(block)) && make_room() < 0) {
+        return -1;
+    }
+    i = lookup(block);
+    if (RESIDENT(i)) {
+        policy->hit(i);
+    } else {
+        i = claim(block);
+    }
+    memcpy(ENTRY_DATA(i), src, block_size);
+    entries[i].copied = ++copies;
+    set_dirty(i, dirty || entries[i].dirty);
+    return 0;
+}
+
+// cache a block just read from the disk, unless it was cached while making
+// room; then the cached copy may be newer. Returns -1 if it was not cached
+static int fill(int block, const char *src) {
+    if (make_room() < 0 || RESIDENT(lookup(block))) {
+        return -1;
+    }
+    return insert(block, src, 0);
+}
+
+static int find_prefetch(int block) {
+    for (int p = 0; p < MAX_PREFETCH; p++) {
+        if (prefetches[p].ticket != 0 && block >= prefetches[p].start
+            && block < prefetches[p].start + prefetches[p].nblocks) {
+            return p;
+        }
+    }
+    return NIL;
+}
+
+// cache what a finished readahead brought in, without replacing newer copies
+static void complete_prefetch(int p, int result) {
+    prefetch_run run = prefetches[p];
+
+    // the slot is let go first, as caching a block may drop the lock to make room
+    prefetches[p].buffer = NULL;
+    prefetches[p].ticket = 0;
+    num_inflight -= run.nblocks;
+    for (int k = 0; k < run.nblocks && result >= 0 && !run.stale; k++) {
+        if (fill(run.start + k, run.buffer + (size_t)k * block_size) == 0) {
+            set_prefetched(lookup(run.start + k), 1);
+            stats.prefetched++;
+        }
+    }
+    free(run.buffer);
+}
+
+static void reap_prefetches() {
+    int result;
+
+    for (int p = 0; p < MAX_PREFETCH; p++) {
+        if (prefetches[p].ticket != 0 && poll_disk(prefetches[p].ticket, &result) == 1) {
+            complete_prefetch(p, result);
+        }
+    }
+}
+
+// a block being read may be on its way already; wait for it rather than read it twice
+static void wait_prefetch(int block) {
+    int p = find_prefetch(block);
+
+    if (p != NIL) {
+        complete_prefetch(p, wait_disk(prefetches[p].ticket));
+    }
+}
+
+static void stale_prefetches(int start_address, int nblocks) {
+    for (int p = 0; p < MAX_PREFETCH; p++) {
+        if (prefetches[p].ticket != 0 && prefetches[p].start < start_address + nblocks
+            && start_address < prefetches[p].start + prefetches[p].nblocks) {
+            prefetches[p].stale = 1;
+        }
+    }
+}
+
+void set_cache_policy(int p) {
+    cache_policy_id = p;
+}
+
+void set_cache_writeback(const cache_writeback *wb) {
+    if (wb == NULL) {
+        memset(&writeback, 0, sizeof(writeback));
+    } else {
+        writeback = *wb;
+    }
+    writeback_set = 1;
+}
+
+int init_cache(int bsize, int blocks) {
+    char *env = getenv("SFS_CACHE_BLOCKS");
+
+    close_cache();
+    if (blocks <= 0) {
+        blocks = env != NULL ? atoi(env) : DEFAULT_CACHE_BLOCKS;
+    }
+    // a cache of no blocks passes every call straight to the disk
+    if (blocks <= 0) {
+        return 0;
+    }
+
+    policy = resolve_policy();
+    resolve_writeback();
+    capacity = blocks;
+    block_size = bsize;
+    // the 2Q paper's suggested sizes: A1in a quarter of the cache, A1out half
+    in_target = capacity / 4 > 0 ? capacity / 4 : 1;
+    ghosts = policy == &policies[CACHE_POLICY_2Q] ? (capacity + 1) / 2 : 0;
+    for (num_buckets = 1; num_buckets < 2 * (capacity + ghosts); num_buckets *= 2) {}
+
+    entries = malloc(sizeof(cache_entry) * (capacity + ghosts));
+    buckets = malloc(sizeof(int) * num_buckets);
+    flush_vec = malloc(sizeof(block_iovec) * capacity);
+    data = alloc_blocks(capacity);
+    // only write-back leaves blocks dirty for a flush to copy
+    if (WRITEBACK) {
+        flush_data = alloc_blocks(capacity);
+        flush_copied = malloc(sizeof(unsigned long long) * capacity);
+    }
+    if (entries == NULL || buckets == NULL || flush_vec == NULL || data == NULL
+        || (WRITEBACK && (flush_data == NULL || flush_copied == NULL))) {
+        close_cache();
+        return -1;
+    }
+
+    for (int i = 0; i < num_buckets; i++) {
+        buckets[i] = NIL;
+    }
+    for (int l = 0; l < NUM_LISTS; l++) {
+        lists[l].head = lists[l].tail = NIL;
+        lists[l].count = 0;
+    }
+    for (int i = 0; i < capacity + ghosts; i++) {
+        entries[i].block = NIL;
+        entries[i].dirty = 0;
+        entries[i].prefetched = 0;
+        entries[i].copied = 0;
+        list_push(i < capacity ? LIST_FREE : LIST_GHOST_FREE, i);
+    }
+    num_dirty = 0;
+    num_unused = 0;
+    num_inflight = 0;
+
+    if (WRITEBACK) {
+        // at least one clean block is always left to evict
+        dirty_limit = (long)capacity * writeback.dirty_ratio / 100;
+        if (dirty_limit >= capacity) dirty_limit = capacity - 1;
+        if (dirty_limit < 1) dirty_limit = 1;
+        background_limit = (long)capacity * writeback.background_ratio / 100;
+        if (writeback.interval_ms <= 0) writeback.interval_ms = 500;
+        flusher_stop = 0;
+        flusher_running = pthread_create(&flusher, NULL, flusher_main, NULL) == 0;
+    }
+    return 0;
+}
+
+void close_cache() {
+    if (flusher_running) {
+        pthread_mutex_lock(&cache_lock);
+        flusher_stop = 1;
+        pthread_cond_signal(&flusher_wake);
+        pthread_mutex_unlock(&cache_lock);
+        pthread_join(flusher, NULL);
+        flusher_running = 0;
+    }
+    pthread_mutex_lock(&cache_lock);
+    for (int p = 0; p < MAX_PREFETCH; p++) {
+        if (prefetches[p].ticket != 0) {
+            prefetches[p].stale = 1;
+            complete_prefetch(p, wait_disk(prefetches[p].ticket));
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (cache_flush() < 0) {
+        printf("block cache: dirty blocks lost on close\n");
+    }
+
+    free(entries);
+    free(buckets);
+    free(flush_vec);
+    free(flush_data);
+    free(flush_copied);
+    free(data);
+    entries = NULL;
+    buckets = NULL;
+    flush_vec = NULL;
+    flush_data = NULL;
+    flush_copied = NULL;
+    data = NULL;
+    capacity = 0;
+    ghosts = 0;
+    num_dirty = 0;
+}
+
+int cache_read_blocks(int start_address, int nblocks, void *buffer) {
+    char *buf = buffer;
+    int i = 0, j, e, rc;
+
+    pthread_mutex_lock(&cache_lock);
+    if (entries == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return read_blocks(start_address, nblocks, buffer);
+    }
+
+    reap_prefetches();
+    while (i < nblocks) {
+        wait_prefetch(start_address + i);
+        e = lookup(start_address + i);
+        if (RESIDENT(e)) {
+            stats.hits++;
+            if (entries[e].prefetched) {
+                stats.readahead_hits++;
+                set_prefetched(e, 0);
+            }
+            memcpy(buf + (size_t)i * block_size, ENTRY_DATA(e), block_size);
+            policy->hit(e);
+            i++;
+            continue;
+        }
+
+        // read the whole run of missing blocks at once, straight into the caller's buffer
+        for (j = i + 1; j < nblocks && !RESIDENT(lookup(start_address + j))
+             && find_prefetch(start_address + j) == NIL; j++) {}
+        rc = read_blocks(start_address + i, j - i, buf + (size_t)i * block_size);
+        if (rc < 0) {
+            pthread_mutex_unlock(&cache_lock);
+            return rc;
+        }
+        stats.misses += j - i;
+        for (; i < j; i++) {
+            // the data is already in the caller's hands if it cannot be cached
+            fill(start_address + i, buf + (size_t)i * block_size);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return nblocks;
+}
+
+// writers that outrun the flusher write back for themselves
+static int balance_dirty() {
+    if (num_dirty > dirty_limit) {
+        stats.throttled++;
+        return flush_dirty(0);
+    }
+    if (num_dirty > background_limit) {
+        pthread_cond_signal(&flusher_wake);
+    }
+    return 0;
+}
+
+int cache_write_blocks(int start_address, int nblocks, void *buffer) {
+    char *buf = buffer;
+    int rc = nblocks;
+
+    pthread_mutex_lock(&cache_lock);
+    if (entries == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return write_blocks(start_address, nblocks, buffer);
+    }
+
+    stale_prefetches(start_address, nblocks);
+    if (WRITEBACK) {
+        for (int i = 0; i < nblocks && rc >= 0; i++) {
+            if (insert(start_address + i, buf + (size_t)i * block_size, 1) < 0) {
+                rc = -1;
+            }
+        }
+        if (balance_dirty() < 0) rc = -1;
+        pthread_mutex_unlock(&cache_lock);
+        return rc;
+    }
+
+    rc = write_blocks(start_address, nblocks, buffer);
+    for (int i = 0; i < nblocks; i++) {
+        // a failed write leaves the disk contents unknown, so forget the blocks
+        if (rc < 0) {
+            int e = lookup(start_address + i);
+            if (RESIDENT(e)) release(e);
+        } else if (insert(start_address + i, buf + (size_t)i * block_size, 0) < 0) {
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+int cache_writev_blocks(block_iovec *iov, int count) {
+    int ok = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if (entries == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return writev_blocks(iov, count);
+    }
+
+    for (int i = 0; i < count; i++) {
+        stale_prefetches(iov[i].block, 1);
+    }
+    if (WRITEBACK) {
+        for (int i = 0; i < count; i++) {
+            iov[i].status = insert(iov[i].block, iov[i].buffer, 1) == 0 ? 1 : -1;
+            ok += iov[i].status > 0;
+        }
+        if (balance_dirty() < 0) ok = 0;
+        pthread_mutex_unlock(&cache_lock);
+        return ok;
+    }
+
+    ok = writev_blocks(iov, count);
+    for (int i = 0; i < count; i++) {
+        if (iov[i].status <= 0) {
+            int e = lookup(iov[i].block);
+            if (RESIDENT(e)) release(e);
+        } else if (insert(iov[i].block, iov[i].buffer, 0) < 0) {
+            ok--;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ok;
+}
+
+int cache_discard_blocks(int start_address, int nblocks) {
+    pthread_mutex_lock(&cache_lock);
+    if (entries != NULL) {
+        stale_prefetches(start_address, nblocks);
+    }
+    for (int i = 0; i < nblocks && entries != NULL; i++) {
+        int e = lookup(start_address + i);
+        // a freed block coming back is not a sign of reuse, so ghosts go too
+        if (e != NIL) release(e);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return discard_blocks(start_address, nblocks);
+}
+
+int cache_prefetch(const int *blocks, int nblocks) {
+    int i, j, p, ticket, issued = 0;
+    int longest = capacity / 2 > 0 ? capacity / 2 : 1;
+    char *buffer;
+
+    pthread_mutex_lock(&cache_lock);
+    if (entries == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return nblocks;
+    }
+
+    reap_prefetches();
+    // reading ahead more than half the cache would evict blocks before they are used
+    longest -= num_unused + num_inflight;
+    for (i = 0; i < nblocks && issued < longest; i = j) {
+        j = i + 1;
+        if (RESIDENT(lookup(blocks[i])) || find_prefetch(blocks[i]) != NIL) {
+            continue;
+        }
+        // adjacent blocks go out as one request
+        while (j < nblocks && issued + j - i < longest && blocks[j] == blocks[j - 1] + 1
+               && !RESIDENT(lookup(blocks[j])) && find_prefetch(blocks[j]) == NIL) {
+            j++;
+        }
+
+        for (p = 0; p < MAX_PREFETCH && prefetches[p].ticket != 0; p++) {}
+        if (p == MAX_PREFETCH) {
+            break;
+        }
+        buffer = alloc_blocks(j - i);
+        ticket = buffer != NULL ? submit_read(blocks[i], j - i, buffer) : -1;
+        if (ticket < 0) {
+            free(buffer);
+            break;
+        }
+        prefetches[p].ticket = ticket;
+        prefetches[p].start = blocks[i];
+        prefetches[p].nblocks = j - i;
+        prefetches[p].stale = 0;
+        prefetches[p].buffer = buffer;
+        num_inflight += j - i;
+        issued += j - i;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return i;
+}
+
+int cache_contains(int block) {
+    int found;
+
+    pthread_mutex_lock(&cache_lock);
+    found = entries != NULL && (RESIDENT(lookup(block)) || find_prefetch(block) != NIL);
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+int cache_flush() {
+    int rc = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if (entries != NULL && num_dirty > 0) {
+        rc = flush_dirty(0);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+void cache_stats(cache_stats_t *out, int reset) {
+    pthread_mutex_lock(&cache_lock);
+    if (out != NULL) {
+        *out = stats;
+        out->dirty = num_dirty;
+    }
+    if (reset) {
+        memset(&stats, 0, sizeof(stats));
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,143 @@
+#ifndef _INCLUDE_BLOCK_CACHE_H_
+#define _INCLUDE_BLOCK_CACHE_H_
+
+#include <stdint.h>
+
+struct block_iovec;
+
+/* blocks cached when neither init_cache nor SFS_CACHE_BLOCKS say otherwise */
+#define DEFAULT_CACHE_BLOCKS 256
+
+/* replacement policies for set_cache_policy */
+#define CACHE_POLICY_LRU 0
+#define CACHE_POLICY_2Q 1
+
+typedef struct cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t ghost_hits;    /* misses on blocks 2Q evicted recently */
+    uint64_t flushes;       /* write-back passes that wrote something */
+    uint64_t flushed;       /* dirty blocks written back */
+    uint64_t throttled;     /* writes that had to flush before returning */
+    uint64_t dirty;         /* blocks dirty right now */
+    uint64_t prefetched;    /* blocks cached by cache_prefetch */
+    uint64_t readahead_hits;    /* hits on prefetched blocks, once per block */
+} cache_stats_t;
+
+/*
+ * @short choose the replacement policy used by the next init_cache
+ * @long Without a call, SFS_CACHE_POLICY ("lru" or "2q") decides, and
+ *       LRU is the default. 2Q keeps blocks read only once, such as a
+ *       file streamed end to end, from pushing out the blocks in use.
+ *
+ * @param policy CACHE_POLICY_LRU or CACHE_POLICY_2Q
+ */
+void set_cache_policy(int policy);
+
+/*
+ * Write-back settings. With dirty_ratio 0 the cache is write-through.
+ * Otherwise cache_write_blocks only dirties cached blocks, and a flusher
+ * thread writes them out every interval_ms once they are expire_ms old,
+ * or all of them once more than background_ratio percent of the cache
+ * is dirty. A write that leaves more than dirty_ratio percent dirty
+ * flushes before it returns. Cached writes reach the disk in no
+ * particular order; only cache_flush orders them before later ones.
+ */
+typedef struct cache_writeback {
+    int dirty_ratio;
+    int background_ratio;
+    int expire_ms;
+    int interval_ms;
+} cache_writeback;
+
+/*
+ * @short choose the write-back settings used by the next init_cache
+ * @long Without a call, SFS_CACHE_WRITEBACK decides: "on" for 20% / 10%
+ *       / 3000ms / 500ms, or overrides such as "ratio=40,expire=1000"
+ *       (keys ratio, background, expire, interval). The default is
+ *       write-through.
+ *
+ * @param wb settings to use, NULL for write-through
+ */
+void set_cache_writeback(const cache_writeback *wb);
+
+/*
+ * @short set up an empty cache in front of the disk
+ * @long Call after init_disk/init_fresh_disk. A capacity of 0 or less
+ *       takes SFS_CACHE_BLOCKS from the environment, or
+ *       DEFAULT_CACHE_BLOCKS.
+ *
+ * @param block_size size of one disk block in bytes
+ * @param capacity number of blocks the cache holds
+ * @return 0 on success, -1 if the cache could not be allocated
+ */
+int init_cache(int block_size, int capacity);
+
+/*
+ * @short write back dirty blocks, then drop every cached block and release the cache
+ */
+void close_cache();
+
+/*
+ * @short read blocks through the cache
+ * @long Cached blocks are copied out; each run of missing blocks is read
+ *       from the disk with one read_blocks call and then cached.
+ * @return nblocks, or a negative value if the disk failed
+ */
+int cache_read_blocks(int start_address, int nblocks, void *buffer);
+
+/*
+ * @short write blocks through the cache, or only into it in write-back mode
+ * @return nblocks, or a negative value if the disk failed
+ */
+int cache_write_blocks(int start_address, int nblocks, void *buffer);
+
+/*
+ * @short write a list of (block, buffer) segments through the cache
+ * @long The cached counterpart of writev_blocks: adjacent segments reach
+ *       the disk as one request, and each status reports its segment.
+ * @return number of segments written
+ */
+int cache_writev_blocks(struct block_iovec *iov, int count);
+
+/*
+ * @short forget cached copies of blocks and discard them on the disk
+ * @return the result of discard_blocks
+ */
+int cache_discard_blocks(int start_address, int nblocks);
+
+/*
+ * @short start reading blocks into the cache in the background
+ * @long Blocks already cached or on their way are skipped, and adjacent
+ *       blocks are read with one request. A later cache_read_blocks of
+ *       a block still in flight waits for it instead of reading it again.
+ *
+ *       At most half the cache is kept read ahead and not yet used.
+ *
+ * @param blocks disk blocks expected to be read soon
+ * @param nblocks number of entries in blocks
+ * @return how many leading entries of blocks were handled; the reads
+ *         for the rest were not started
+ */
+int cache_prefetch(const int *blocks, int nblocks);
+
+/*
+ * @short whether a block is cached or being read ahead
+ */
+int cache_contains(int block);
+
+/*
+ * @short write every dirty block to the disk
+ * @return 0, or -1 if some blocks could not be written and are still dirty
+ */
+int cache_flush();
+
+/*
+ * @short copy the hit/miss/ghost counters out and optionally clear them
+ * @param out where to copy the counters, may be NULL
+ * @param reset clear the counters after copying
+ */
+void cache_stats(cache_stats_t *out, int reset);
+
+#endif //_INCLUDE_BLOCK_CACHE_H_
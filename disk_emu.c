@@ -1,181 +1,1676 @@
-#include <stdio.h>
-#include <stdlib.h> 
-#include <string.h>
-#include <unistd.h>
-#include <time.h>
-#include "disk_emu.h"
-
-
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
-
-/*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
-/*----------------------------------------------------------*/
-int close_disk()
-{
-    if(NULL != fp)
-    {
-        fclose(fp);
-    }
-    return 0;
-}
-
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
-{
-    int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not create new disk file %s\n\n", filename);
-        return -1;
-    }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
-    {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
-    }
-    return 0;
-}
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
-{
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not open %s\n\n", filename);
-        return -1;
-    }
-    return 0;
-}
-
-/*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
-/*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, j, e, s;
-    e = 0;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error %d\n", start_address);
-
-        return -1;
-    }
-
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
-
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-
-       for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-        }
-    }
-
-    free(blockRead);
-
-
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
-}
-
-/*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
-/*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, e, s;
-    e = 0;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error\n");
-        return -1;
-    }
-
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
-    }
-    free(blockWrite);
-
-    /*If no failure return the number of blocks written, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
-}
+/*fallocate and its FALLOC_FL_* flags*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "disk_emu.h"
+
+/*Most segments merged into one preadv/pwritev*/
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*Buffer alignment O_DIRECT transfers need, and what alloc_blocks hands out*/
+#define DISK_ALIGN 4096
+#define IS_ALIGNED(_ptr) (((uintptr_t)(_ptr) & (DISK_ALIGN - 1)) == 0)
+
+/*Backend part of a mode, without the flags*/
+#define DISK_BACKEND(_mode) ((_mode) & 0xff)
+
+/*Blocks held by the write-back staging area before it drains itself*/
+#define STAGE_SLOTS 256
+#define STAGE_BUCKETS (2 * STAGE_SLOTS)
+
+/*Requests that can be submitted and not yet reaped at once*/
+#define QUEUE_DEPTH 64
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS 16
+
+/*Life cycle of a queued request*/
+#define REQ_FREE 0
+#define REQ_QUEUED 1
+#define REQ_RUNNING 2
+#define REQ_DONE 3
+
+typedef struct disk_request {
+    int ticket;
+    int state;
+    int write;
+    int start_address;
+    int nblocks;
+    void *buffer;
+    int result;
+} disk_request;
+
+/*Images a disk can be striped over, and blocks per stripe unit*/
+#define MAX_MEMBERS 16
+#define DEFAULT_STRIPE 16
+
+/*Piece of a striped request handed to a member's thread*/
+typedef struct stripe_job {
+    struct stripe_job *next;
+    int write;
+    int block;
+    struct iovec *vec;
+    int nvec;
+    int result;
+    int *pending;
+} stripe_job;
+
+/*One image file backing the disk, and the device model state of it*/
+typedef struct member {
+    int fd;
+    char *map;
+    size_t map_len;
+    int head_block;
+    int busy;
+    pthread_t thread;
+    int has_thread;
+    int stop;
+    pthread_cond_t work;
+    stripe_job *jobs;
+} member;
+
+static int transfer_vector(int write, block_iovec *iov, int count);
+static int read_run(int start_address, int nblocks, void *buffer);
+static int write_run(int start_address, int nblocks, void *buffer);
+static void resolve_disk_model();
+static void stop_workers();
+
+static int disk_mode = -1;
+static int direct_io = 0;
+/*per-thread aligned bounce buffer for O_DIRECT transfers from unaligned memory*/
+static pthread_key_t bounce_key;
+static pthread_once_t bounce_once = PTHREAD_ONCE_INIT;
+/*member images; a striped disk spreads its blocks over several*/
+static member members[MAX_MEMBERS];
+static int num_members = 0;
+static int member_blocks = 0;
+static int stripe_blocks = DEFAULT_STRIPE;
+static int stripe_set = 0;
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripe_done = PTHREAD_COND_INITIALIZER;
+/*write-back staging area: staged block copies indexed by an open-addressed hash*/
+static char *stage_data = NULL;
+static int stage_block[STAGE_SLOTS];
+static int stage_bucket[STAGE_BUCKETS];
+static int stage_count = 0;
+static pthread_mutex_t stage_lock = PTHREAD_MUTEX_INITIALIZER;
+/*asynchronous submission/completion queue served by a pool of workers*/
+static disk_request queue[QUEUE_DEPTH];
+static int next_ticket = 1;
+static int inflight = 0;
+static int num_workers = -1;
+static int workers_stop = 0;
+static pthread_t workers[MAX_WORKERS];
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_done = PTHREAD_COND_INITIALIZER;
+/*device performance model and the state it simulates*/
+static disk_model model;
+static int model_set = 0;
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t model_free = PTHREAD_COND_INITIALIZER;
+/*I/O statistics, updated with atomic adds*/
+static disk_stats_t stats;
+static int stats_next_block = -1;
+int BLOCK_SIZE, MAX_BLOCK;
+
+/*------------------------------------------------------------------*/
+/*Allocates zeroed, page aligned memory for nblocks blocks; release  */
+/*it with free()                                                     */
+/*------------------------------------------------------------------*/
+void *alloc_blocks(int nblocks)
+{
+    void *buffer = NULL;
+    size_t len = (size_t)(nblocks > 0 ? nblocks : 1) * BLOCK_SIZE;
+
+    if (posix_memalign(&buffer, DISK_ALIGN, len) != 0)
+        return NULL;
+    memset(buffer, 0, len);
+    return buffer;
+}
+
+typedef struct bounce_buffer {
+    void *data;
+    size_t len;
+} bounce_buffer;
+
+static void free_bounce(void *arg)
+{
+    bounce_buffer *b = arg;
+
+    free(b->data);
+    free(b);
+}
+
+static void make_bounce_key()
+{
+    pthread_key_create(&bounce_key, free_bounce);
+}
+
+/*------------------------------------------------------------------*/
+/*Returns this thread's aligned bounce buffer, grown to len bytes    */
+/*------------------------------------------------------------------*/
+static void *get_bounce(size_t len)
+{
+    bounce_buffer *b;
+
+    pthread_once(&bounce_once, make_bounce_key);
+    b = pthread_getspecific(bounce_key);
+    if (NULL == b)
+    {
+        b = calloc(1, sizeof(bounce_buffer));
+        if (NULL == b)
+            return NULL;
+        pthread_setspecific(bounce_key, b);
+    }
+    if (b->len < len)
+    {
+        free(b->data);
+        b->data = NULL;
+        b->len = 0;
+        if (posix_memalign(&b->data, DISK_ALIGN, len) != 0)
+        {
+            b->data = NULL;
+            return NULL;
+        }
+        b->len = len;
+    }
+    return b->data;
+}
+
+static int pwrite_full(int fd, const void *buffer, size_t len, off_t off);
+
+/*----------------------------------------------------------------*/
+/*Reads len bytes at offset off, retrying on short reads and EINTR */
+/*----------------------------------------------------------------*/
+static int pread_full(int fd, void *buffer, size_t len, off_t off)
+{
+    char *dst = buffer;
+    ssize_t n;
+
+    /*O_DIRECT can only transfer into aligned memory*/
+    if (direct_io && !IS_ALIGNED(buffer))
+    {
+        void *bounce = get_bounce(len);
+
+        if (NULL == bounce || pread_full(fd, bounce, len, off) < 0)
+            return -1;
+        memcpy(buffer, bounce, len);
+        return 0;
+    }
+
+    while (len > 0)
+    {
+        n = pread(fd, dst, len, off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        /*Reading past the end of the image returns zeros*/
+        if (n == 0)
+        {
+            memset(dst, 0, len);
+            break;
+        }
+        dst += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------*/
+/*Writes len bytes at offset off, retrying on short writes and EINTR*/
+/*-----------------------------------------------------------------*/
+static int pwrite_full(int fd, const void *buffer, size_t len, off_t off)
+{
+    const char *src = buffer;
+    ssize_t n;
+
+    /*O_DIRECT can only transfer from aligned memory*/
+    if (direct_io && !IS_ALIGNED(buffer))
+    {
+        void *bounce = get_bounce(len);
+
+        if (NULL == bounce)
+            return -1;
+        memcpy(bounce, buffer, len);
+        return pwrite_full(fd, bounce, len, off);
+    }
+
+    while (len > 0)
+    {
+        n = pwrite(fd, src, len, off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        src += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------*/
+/*Selects the backend used by the next init_disk/init_fresh_disk*/
+/*------------------------------------------------------------*/
+void set_disk_mode(int mode)
+{
+    disk_mode = mode;
+}
+
+/*------------------------------------------------------------------*/
+/*Resolves the mode: an explicit set_disk_mode wins, then the        */
+/*SFS_DISK_MODE environment variable, a comma separated list such as */
+/*"mmap,writeback", then plain pread                                 */
+/*------------------------------------------------------------------*/
+static int resolve_disk_mode()
+{
+    char *env, *copy, *tok, *save;
+    int mode = DISK_MODE_PREAD;
+
+    if (disk_mode >= 0)
+        return disk_mode;
+
+    env = getenv("SFS_DISK_MODE");
+    if (env == NULL)
+        return mode;
+
+    copy = strdup(env);
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        if (strcmp(tok, "mmap") == 0)
+            mode = (mode & ~0xff) | DISK_MODE_MMAP;
+        else if (strcmp(tok, "pread") == 0)
+            mode = (mode & ~0xff) | DISK_MODE_PREAD;
+        else if (strcmp(tok, "direct") == 0)
+            mode = (mode & ~0xff) | DISK_MODE_DIRECT;
+        else if (strcmp(tok, "writeback") == 0)
+            mode |= DISK_MODE_WRITEBACK;
+        else if (strcmp(tok, "prealloc") == 0)
+            mode |= DISK_MODE_PREALLOC;
+    }
+    free(copy);
+    return mode;
+}
+
+/*------------------------------------------------------------------*/
+/*Selects the device model used by the next init_disk/init_fresh_disk*/
+/*------------------------------------------------------------------*/
+void set_disk_model(const disk_model *m)
+{
+    model = *m;
+    model_set = 1;
+}
+
+/*------------------------------------------------------------------*/
+/*Resolves the device model: an explicit set_disk_model wins, then   */
+/*SFS_DISK_MODEL, a profile name ("ssd", "nvme", "hdd") and/or       */
+/*key=value overrides such as "hdd,qd=2,fail=0.01", then a device    */
+/*that costs nothing and never fails                                 */
+/*------------------------------------------------------------------*/
+static void resolve_disk_model()
+{
+    static const disk_model none = { 0, 0, 0, 0, 0, 0, 0, 3 };
+    static const disk_model ssd = { 80, 0, 0, 0, 500, 32, 0, 3 };
+    static const disk_model nvme = { 20, 0, 0, 0, 2000, 64, 0, 3 };
+    static const disk_model hdd = { 4000, 500, 2, 8000, 150, 1, 0, 3 };
+    char *env, *copy, *tok, *save, *val;
+
+    if (model_set)
+        return;
+
+    model = none;
+    env = getenv("SFS_DISK_MODEL");
+    if (env == NULL)
+        return;
+
+    copy = strdup(env);
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        val = strchr(tok, '=');
+        if (val == NULL)
+        {
+            if (strcmp(tok, "ssd") == 0)
+                model = ssd;
+            else if (strcmp(tok, "nvme") == 0)
+                model = nvme;
+            else if (strcmp(tok, "hdd") == 0)
+                model = hdd;
+            else if (strcmp(tok, "none") == 0)
+                model = none;
+            continue;
+        }
+        *val++ = '\0';
+        if (strcmp(tok, "latency") == 0)
+            model.latency_us = atof(val);
+        else if (strcmp(tok, "seek") == 0)
+            model.seek_us = atof(val);
+        else if (strcmp(tok, "seek_per_block") == 0)
+            model.seek_us_per_block = atof(val);
+        else if (strcmp(tok, "seek_max") == 0)
+            model.seek_max_us = atof(val);
+        else if (strcmp(tok, "bw") == 0)
+            model.bandwidth_mb = atof(val);
+        else if (strcmp(tok, "qd") == 0)
+            model.queue_depth = atoi(val);
+        else if (strcmp(tok, "fail") == 0)
+            model.failure_rate = atof(val);
+        else if (strcmp(tok, "retry") == 0)
+            model.max_retry = atoi(val);
+    }
+    free(copy);
+}
+
+/*------------------------------------------------------------------*/
+/*Charges one device request to the model of the member image it is  */
+/*aimed at: waits for a free queue slot, then sleeps for its latency,*/
+/*seek and transfer time. Each attempt may fail and is retried up to */
+/*max_retry times. Returns 0, or the negative number of failures if  */
+/*every attempt failed                                               */
+/*------------------------------------------------------------------*/
+static int model_request(member *m, int start_address, int nblocks)
+{
+    struct timespec ts;
+    double us, distance, r;
+    int failures = 0;
+
+    if (model.latency_us <= 0 && model.seek_us <= 0 && model.seek_us_per_block <= 0
+        && model.bandwidth_mb <= 0 && model.queue_depth <= 0 && model.failure_rate <= 0)
+    {
+        return 0;
+    }
+
+    for (;;)
+    {
+        pthread_mutex_lock(&model_lock);
+        while (model.queue_depth > 0 && m->busy >= model.queue_depth)
+            pthread_cond_wait(&model_free, &model_lock);
+        m->busy++;
+
+        /*Seeking costs nothing for a request that continues the last one*/
+        us = model.latency_us;
+        if (start_address != m->head_block)
+        {
+            distance = abs(start_address - m->head_block);
+            us += model.seek_us + distance * model.seek_us_per_block;
+            if (model.seek_max_us > 0 && us > model.latency_us + model.seek_max_us)
+                us = model.latency_us + model.seek_max_us;
+        }
+        if (model.bandwidth_mb > 0)
+            us += (double)nblocks * BLOCK_SIZE / model.bandwidth_mb;
+        m->head_block = start_address + nblocks;
+        r = (double)rand() / RAND_MAX;
+        pthread_mutex_unlock(&model_lock);
+
+        if (us > 0)
+        {
+            ts.tv_sec = (time_t)(us / 1000000);
+            ts.tv_nsec = (long)((us - ts.tv_sec * 1000000.0) * 1000);
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                ;
+        }
+
+        pthread_mutex_lock(&model_lock);
+        m->busy--;
+        pthread_cond_broadcast(&model_free);
+        pthread_mutex_unlock(&model_lock);
+
+        if (r >= model.failure_rate)
+            return 0;
+        if (++failures > model.max_retry)
+            return -failures;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Selects how many consecutive blocks go to one image before moving  */
+/*to the next, for the next init_disk/init_fresh_disk                */
+/*------------------------------------------------------------------*/
+void set_disk_stripe(int blocks)
+{
+    stripe_set = blocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Maps a whole member image into memory, growing the file if short  */
+/*------------------------------------------------------------------*/
+static int map_member(member *m)
+{
+    struct stat st;
+    size_t len = (size_t)member_blocks * BLOCK_SIZE;
+
+    if (fstat(m->fd, &st) < 0)
+        return -1;
+    /*Accessing a mapping beyond end of file raises SIGBUS*/
+    if ((size_t)st.st_size < len && ftruncate(m->fd, len) < 0)
+        return -1;
+
+    m->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (m->map == MAP_FAILED)
+    {
+        m->map = NULL;
+        return -1;
+    }
+    m->map_len = len;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Transfers one member-contiguous run whose memory is described by   */
+/*vec with preadv/pwritev, falling back to one call per entry if the */
+/*kernel moves less than the whole run                               */
+/*------------------------------------------------------------------*/
+static int member_io(int write, member *m, int block, struct iovec *vec, int nvec)
+{
+    off_t off = (off_t)block * BLOCK_SIZE, seg;
+    ssize_t total = 0, done;
+    int i, n, rc, aligned = 1;
+
+    for (i = 0; i < nvec; i++)
+    {
+        total += vec[i].iov_len;
+        aligned &= IS_ALIGNED(vec[i].iov_base);
+    }
+    rc = model_request(m, block, total / BLOCK_SIZE);
+    if (rc < 0)
+        return rc;
+
+    /*A mapped image is accessed with plain memory copies*/
+    if (NULL != m->map)
+    {
+        for (i = 0; i < nvec; i++)
+        {
+            if (write)
+                memcpy(m->map + off, vec[i].iov_base, vec[i].iov_len);
+            else
+                memcpy(vec[i].iov_base, m->map + off, vec[i].iov_len);
+            off += vec[i].iov_len;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < nvec; i += n)
+    {
+        n = nvec - i < IOV_MAX ? nvec - i : IOV_MAX;
+        for (total = 0, rc = 0; rc < n; rc++)
+            total += vec[i + rc].iov_len;
+
+        /*With O_DIRECT, unaligned memory goes through the bounce buffer*/
+        done = -1;
+        while ((aligned || !direct_io) && done < 0)
+        {
+            done = write ? pwritev(m->fd, &vec[i], n, off) : preadv(m->fd, &vec[i], n, off);
+            if (done < 0 && errno != EINTR)
+                break;
+        }
+        if (done != total)
+        {
+            /*Short transfer: finish entry by entry*/
+            for (rc = 0, seg = off; rc < n; seg += vec[i + rc].iov_len, rc++)
+            {
+                if ((write ? pwrite_full(m->fd, vec[i + rc].iov_base, vec[i + rc].iov_len, seg)
+                           : pread_full(m->fd, vec[i + rc].iov_base, vec[i + rc].iov_len, seg)) < 0)
+                {
+                    return -1;
+                }
+            }
+        }
+        off += total;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Member thread: serves the pieces of striped requests aimed at its  */
+/*image so that all members transfer in parallel                     */
+/*------------------------------------------------------------------*/
+static void *member_worker(void *arg)
+{
+    member *m = arg;
+    stripe_job *job;
+    int result;
+
+    pthread_mutex_lock(&stripe_lock);
+    for (;;)
+    {
+        while (NULL == m->jobs && !m->stop)
+            pthread_cond_wait(&m->work, &stripe_lock);
+        if (NULL == m->jobs)
+            break;
+
+        job = m->jobs;
+        m->jobs = job->next;
+        pthread_mutex_unlock(&stripe_lock);
+
+        result = member_io(job->write, m, job->block, job->vec, job->nvec);
+
+        pthread_mutex_lock(&stripe_lock);
+        job->result = result;
+        (*job->pending)--;
+        pthread_cond_broadcast(&stripe_done);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return NULL;
+}
+
+/*------------------------------------------------------------------*/
+/*Splits a run of logical blocks into one member-contiguous piece    */
+/*list per member. With lists NULL it only counts the pieces         */
+/*------------------------------------------------------------------*/
+static void stripe_split(int start_address, int nblocks, struct iovec *vec,
+                         int *count, int *first, struct iovec **lists)
+{
+    int b = start_address, left = nblocks, vi = 0;
+    int unit, within, idx, n;
+    size_t vo = 0, bytes, take;
+
+    memset(count, 0, sizeof(int) * num_members);
+    while (left > 0)
+    {
+        unit = b / stripe_blocks;
+        within = b % stripe_blocks;
+        idx = unit % num_members;
+        n = stripe_blocks - within < left ? stripe_blocks - within : left;
+
+        /*Consecutive stripe units on one member sit next to each other there*/
+        if (count[idx] == 0)
+            first[idx] = (unit / num_members) * stripe_blocks + within;
+
+        for (bytes = (size_t)n * BLOCK_SIZE; bytes > 0; bytes -= take)
+        {
+            take = vec[vi].iov_len - vo < bytes ? vec[vi].iov_len - vo : bytes;
+            if (NULL != lists)
+            {
+                lists[idx][count[idx]].iov_base = (char *)vec[vi].iov_base + vo;
+                lists[idx][count[idx]].iov_len = take;
+            }
+            count[idx]++;
+            vo += take;
+            if (vo == vec[vi].iov_len)
+            {
+                vi++;
+                vo = 0;
+            }
+        }
+        b += n;
+        left -= n;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Transfers a run of logical blocks whose memory is described by vec.*/
+/*A striped run is split per member and the pieces are transferred   */
+/*in parallel, one member-contiguous call each                       */
+/*------------------------------------------------------------------*/
+static int device_transfer(int write, int start_address, int nblocks, struct iovec *vec, int nvec)
+{
+    stripe_job jobs[MAX_MEMBERS];
+    struct iovec *lists[MAX_MEMBERS], *pieces;
+    int count[MAX_MEMBERS], first[MAX_MEMBERS];
+    int i, total = 0, pending = 0, mine = -1, rc = 0;
+
+    /*Requests that actually reach the images, after staging and merging*/
+    __atomic_fetch_add(&stats.device_requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.device_blocks, nblocks, __ATOMIC_RELAXED);
+
+    if (num_members == 1)
+        return member_io(write, &members[0], start_address, vec, nvec);
+
+    stripe_split(start_address, nblocks, vec, count, first, NULL);
+    for (i = 0; i < num_members; i++)
+        total += count[i];
+    pieces = malloc(sizeof(struct iovec) * total);
+    if (NULL == pieces)
+        return -1;
+    for (i = 0, total = 0; i < num_members; i++)
+    {
+        lists[i] = pieces + total;
+        total += count[i];
+    }
+    stripe_split(start_address, nblocks, vec, count, first, lists);
+
+    /*Hand every member but one to its thread, and do that one here*/
+    pthread_mutex_lock(&stripe_lock);
+    for (i = 0; i < num_members; i++)
+    {
+        if (count[i] == 0)
+            continue;
+        if (mine < 0)
+        {
+            mine = i;
+            continue;
+        }
+        jobs[i].write = write;
+        jobs[i].block = first[i];
+        jobs[i].vec = lists[i];
+        jobs[i].nvec = count[i];
+        jobs[i].pending = &pending;
+        jobs[i].next = NULL;
+        if (NULL == members[i].jobs)
+        {
+            members[i].jobs = &jobs[i];
+        }
+        else
+        {
+            stripe_job *tail = members[i].jobs;
+            while (NULL != tail->next)
+                tail = tail->next;
+            tail->next = &jobs[i];
+        }
+        pending++;
+        pthread_cond_signal(&members[i].work);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+
+    if (mine >= 0)
+        rc = member_io(write, &members[mine], first[mine], lists[mine], count[mine]);
+
+    pthread_mutex_lock(&stripe_lock);
+    while (pending > 0)
+        pthread_cond_wait(&stripe_done, &stripe_lock);
+    pthread_mutex_unlock(&stripe_lock);
+
+    for (i = 0; i < num_members; i++)
+    {
+        if (i != mine && count[i] > 0 && jobs[i].result < rc)
+            rc = jobs[i].result;
+    }
+    free(pieces);
+    return rc;
+}
+
+/*------------------------------------------------------------------*/
+/*Splits a comma separated list of image files into the members and  */
+/*opens each of them with flags                                      */
+/*------------------------------------------------------------------*/
+static int open_members(char *filename, int flags)
+{
+    char *copy, *tok, *save;
+    char *env = getenv("SFS_DISK_STRIPE");
+
+    num_members = 0;
+    copy = strdup(filename);
+    for (tok = strtok_r(copy, ",", &save); tok != NULL && num_members < MAX_MEMBERS;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        memset(&members[num_members], 0, sizeof(member));
+        members[num_members].fd = open(tok, flags, 0644);
+        if (members[num_members].fd < 0)
+        {
+            printf("Could not open %s\n\n", tok);
+            free(copy);
+            close_disk();
+            return -1;
+        }
+        num_members++;
+    }
+    free(copy);
+    if (num_members == 0)
+        return -1;
+
+    /*An explicit set_disk_stripe wins over SFS_DISK_STRIPE*/
+    stripe_blocks = stripe_set > 0 ? stripe_set : (env != NULL ? atoi(env) : 0);
+    if (stripe_blocks <= 0)
+        stripe_blocks = DEFAULT_STRIPE;
+
+    /*Every member holds the same whole number of stripe units*/
+    if (num_members == 1)
+    {
+        member_blocks = MAX_BLOCK;
+    }
+    else
+    {
+        member_blocks = (MAX_BLOCK + stripe_blocks * num_members - 1) / (stripe_blocks * num_members);
+        member_blocks *= stripe_blocks;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Sets up the backend chosen by the mode on the freshly opened images*/
+/*------------------------------------------------------------------*/
+static int setup_backend()
+{
+    int mode = resolve_disk_mode();
+    int i;
+
+    direct_io = DISK_BACKEND(mode) == DISK_MODE_DIRECT;
+    for (i = 0; i < num_members; i++)
+    {
+        if (DISK_BACKEND(mode) == DISK_MODE_MMAP && map_member(&members[i]) < 0)
+            return -1;
+
+        /*Bypass the host page cache. Filesystems such as tmpfs refuse
+          O_DIRECT, and the images are then used buffered*/
+        if (direct_io && (BLOCK_SIZE % 512 != 0
+            || fcntl(members[i].fd, F_SETFL, fcntl(members[i].fd, F_GETFL) | O_DIRECT) < 0))
+        {
+            printf("O_DIRECT not available, using buffered I/O\n");
+            direct_io = 0;
+        }
+    }
+    if (!direct_io)
+    {
+        for (i = 0; i < num_members; i++)
+            fcntl(members[i].fd, F_SETFL, fcntl(members[i].fd, F_GETFL) & ~O_DIRECT);
+    }
+
+    /*Striped requests run on one thread per member*/
+    for (i = 0; i < num_members && num_members > 1; i++)
+    {
+        pthread_cond_init(&members[i].work, NULL);
+        if (pthread_create(&members[i].thread, NULL, member_worker, &members[i]) != 0)
+            return -1;
+        members[i].has_thread = 1;
+    }
+
+    /*A shared mapping already buffers writes, so only pread stages them*/
+    if ((mode & DISK_MODE_WRITEBACK) && DISK_BACKEND(mode) != DISK_MODE_MMAP)
+    {
+        stage_data = alloc_blocks(STAGE_SLOTS);
+        if (NULL == stage_data)
+            return -1;
+        stage_count = 0;
+        memset(stage_bucket, 0, sizeof(stage_bucket));
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Close the disk file filled when you don't need it anymore. */
+/*----------------------------------------------------------*/
+int close_disk()
+{
+    int i;
+
+    /*Queued and staged writes must reach the image before it is closed*/
+    barrier();
+    stop_workers();
+    if(NULL != stage_data)
+    {
+        free(stage_data);
+        stage_data = NULL;
+    }
+    for (i = 0; i < num_members; i++)
+    {
+        if (members[i].has_thread)
+        {
+            pthread_mutex_lock(&stripe_lock);
+            members[i].stop = 1;
+            pthread_cond_signal(&members[i].work);
+            pthread_mutex_unlock(&stripe_lock);
+            pthread_join(members[i].thread, NULL);
+            pthread_cond_destroy(&members[i].work);
+        }
+        if(NULL != members[i].map)
+        {
+            /*The only durability point of a mapped image*/
+            msync(members[i].map, members[i].map_len, MS_SYNC);
+            munmap(members[i].map, members[i].map_len);
+        }
+        if(members[i].fd >= 0)
+        {
+            close(members[i].fd);
+        }
+    }
+    num_members = 0;
+    return 0;
+}
+
+/*---------------------------------------*/
+/*Initializes a disk file filled with 0's*/
+/*---------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    off_t len;
+    int i;
+
+    close_disk();
+
+    /*Set up the device performance model*/
+    resolve_disk_model();
+
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+    /*Creates the new files; a comma separated list stripes the disk over them*/
+    if (open_members(filename, O_RDWR | O_CREAT | O_TRUNC) < 0)
+    {
+        printf("Could not create new disk file %s\n\n", filename);
+        return -1;
+    }
+
+    /*Sizes the files without writing them: unwritten ranges read back as 0's.
+      With DISK_MODE_PREALLOC the space is also reserved up front*/
+    for (i = 0; i < num_members; i++)
+    {
+        len = (off_t)member_blocks * BLOCK_SIZE;
+        if ((resolve_disk_mode() & DISK_MODE_PREALLOC) && fallocate(members[i].fd, 0, 0, len) == 0)
+            len = -1;
+        if (len >= 0 && ftruncate(members[i].fd, len) < 0)
+        {
+            printf("Could not size disk file %s\n\n", filename);
+            return -1;
+        }
+    }
+
+    if (setup_backend() < 0)
+    {
+        printf("Could not set up disk file %s\n\n", filename);
+        return -1;
+    }
+    return 0;
+}
+/*----------------------------*/
+/*Initializes an existing disk*/
+/*----------------------------*/
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    close_disk();
+
+    /*Set up the device performance model*/
+    resolve_disk_model();
+
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+
+    /*Opens the files; a comma separated list stripes the disk over them*/
+    if (open_members(filename, O_RDWR) < 0)
+    {
+        printf("Could not open %s\n\n", filename);
+        return -1;
+    }
+
+    if (setup_backend() < 0)
+    {
+        printf("Could not set up %s\n\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads a run of blocks from the image, bypassing the staging area   */
+/*------------------------------------------------------------------*/
+static int device_read(int start_address, int nblocks, void *buffer)
+{
+    struct iovec vec = { buffer, (size_t)nblocks * BLOCK_SIZE };
+
+    /*Reads the whole run straight into the caller's buffer*/
+    return device_transfer(0, start_address, nblocks, &vec, 1);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a run of blocks to the image, bypassing the staging area    */
+/*------------------------------------------------------------------*/
+static int device_write(int start_address, int nblocks, const void *buffer)
+{
+    struct iovec vec = { (void *)buffer, (size_t)nblocks * BLOCK_SIZE };
+
+    /*Writes the whole run straight from the caller's buffer*/
+    return device_transfer(1, start_address, nblocks, &vec, 1);
+}
+
+/*------------------------------------------------------------------*/
+/*Finds the staging slot holding a block, or -1                      */
+/*------------------------------------------------------------------*/
+static int stage_find(int block)
+{
+    int h = block % STAGE_BUCKETS;
+
+    while (stage_bucket[h] != 0)
+    {
+        if (stage_block[stage_bucket[h] - 1] == block)
+            return stage_bucket[h] - 1;
+        h = (h + 1) % STAGE_BUCKETS;
+    }
+    return -1;
+}
+
+/*------------------------------------------------------------------*/
+/*Copies staged blocks that fall inside a run over the data read     */
+/*------------------------------------------------------------------*/
+static void stage_overlay(int start_address, int nblocks, void *buffer)
+{
+    int i, slot;
+
+    if (stage_count == 0)
+        return;
+
+    if (nblocks <= stage_count)
+    {
+        for (i = 0; i < nblocks; i++)
+        {
+            slot = stage_find(start_address + i);
+            if (slot >= 0)
+                memcpy((char *)buffer + (size_t)i * BLOCK_SIZE, stage_data + (size_t)slot * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        return;
+    }
+    for (slot = 0; slot < stage_count; slot++)
+    {
+        i = stage_block[slot] - start_address;
+        if (i >= 0 && i < nblocks)
+            memcpy((char *)buffer + (size_t)i * BLOCK_SIZE, stage_data + (size_t)slot * BLOCK_SIZE, BLOCK_SIZE);
+    }
+}
+
+static int compare_iovec(const void *a, const void *b)
+{
+    return ((const block_iovec *)a)->block - ((const block_iovec *)b)->block;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes every staged block to the image in block order, merging     */
+/*neighbours, and empties the staging area. If any write fails all   */
+/*the blocks stay staged, so the next barrier tries them again       */
+/*------------------------------------------------------------------*/
+static int stage_drain()
+{
+    block_iovec iov[STAGE_SLOTS];
+    int i, n = stage_count;
+
+    if (n == 0)
+        return 0;
+
+    for (i = 0; i < n; i++)
+    {
+        iov[i].block = stage_block[i];
+        iov[i].buffer = stage_data + (size_t)i * BLOCK_SIZE;
+        iov[i].status = 0;
+    }
+    qsort(iov, n, sizeof(block_iovec), compare_iovec);
+
+    if (transfer_vector(1, iov, n) != n)
+        return -1;
+
+    stage_count = 0;
+    memset(stage_bucket, 0, sizeof(stage_bucket));
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Stages one block, draining the staging area first if it is full    */
+/*------------------------------------------------------------------*/
+static int stage_put(int block, const void *buffer)
+{
+    int slot = stage_find(block);
+    int h;
+
+    if (slot < 0)
+    {
+        if (stage_count == STAGE_SLOTS && stage_drain() < 0)
+            return -1;
+
+        slot = stage_count++;
+        stage_block[slot] = block;
+        h = block % STAGE_BUCKETS;
+        while (stage_bucket[h] != 0)
+            h = (h + 1) % STAGE_BUCKETS;
+        stage_bucket[h] = slot + 1;
+    }
+    memcpy(stage_data + (size_t)slot * BLOCK_SIZE, buffer, BLOCK_SIZE);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Starts timing a request for the statistics                         */
+/*------------------------------------------------------------------*/
+static void stats_begin(struct timespec *t0)
+{
+    clock_gettime(CLOCK_MONOTONIC, t0);
+}
+
+/*------------------------------------------------------------------*/
+/*Accounts a finished read_blocks/write_blocks/readv/writev call: a  */
+/*request is sequential when it starts where the previous one ended  */
+/*------------------------------------------------------------------*/
+static void stats_end(int write, int start_address, int nblocks, int rc, struct timespec *t0)
+{
+    struct timespec t1;
+    unsigned long long us;
+    int bucket = 0, prev;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    us = (unsigned long long)(t1.tv_sec - t0->tv_sec) * 1000000ULL
+         + (t1.tv_nsec - t0->tv_nsec) / 1000;
+    if (us > 0)
+        bucket = 64 - __builtin_clzll(us);
+    if (bucket >= DISK_HIST_BUCKETS)
+        bucket = DISK_HIST_BUCKETS - 1;
+
+    prev = __atomic_exchange_n(&stats_next_block, start_address + nblocks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(prev == start_address ? &stats.sequential : &stats.random, 1, __ATOMIC_RELAXED);
+    if (rc < 0)
+        __atomic_fetch_add(&stats.errors, 1, __ATOMIC_RELAXED);
+
+    if (write)
+    {
+        __atomic_fetch_add(&stats.writes, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.blocks_written, nblocks, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.bytes_written, (unsigned long long)nblocks * BLOCK_SIZE, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.write_latency[bucket], 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&stats.reads, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.blocks_read, nblocks, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.bytes_read, (unsigned long long)nblocks * BLOCK_SIZE, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.read_latency[bucket], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Copies the I/O statistics into out when it is not NULL, then       */
+/*clears them if reset is set. Writers add to the counters without a */
+/*lock, so each one is read, or read and cleared, atomically         */
+/*------------------------------------------------------------------*/
+void disk_stats(disk_stats_t *out, int reset)
+{
+    unsigned long long *counters = (unsigned long long *)&stats;
+    unsigned long long value;
+    size_t i;
+
+    for (i = 0; i < sizeof(disk_stats_t) / sizeof(unsigned long long); i++)
+    {
+        if (reset)
+            value = __atomic_exchange_n(&counters[i], 0, __ATOMIC_RELAXED);
+        else
+            value = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        if (NULL != out)
+            ((unsigned long long *)out)[i] = value;
+    }
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    struct timespec t0;
+    int rc;
+
+    stats_begin(&t0);
+    rc = read_run(start_address, nblocks, buffer);
+    stats_end(0, start_address, nblocks, rc, &t0);
+    return rc;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    struct timespec t0;
+    int rc;
+
+    stats_begin(&t0);
+    rc = write_run(start_address, nblocks, buffer);
+    stats_end(1, start_address, nblocks, rc, &t0);
+    return rc;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads a run of blocks, overlaying staged writes                    */
+/*------------------------------------------------------------------*/
+static int read_run(int start_address, int nblocks, void *buffer)
+{
+    int rc;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || nblocks < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+
+        return -1;
+    }
+
+    if (NULL != stage_data)
+    {
+        /*Staged writes are newer than what the image holds; the lock keeps
+          a concurrent drain from slipping between the read and the overlay*/
+        pthread_mutex_lock(&stage_lock);
+        rc = device_read(start_address, nblocks, buffer);
+        stage_overlay(start_address, nblocks, buffer);
+        pthread_mutex_unlock(&stage_lock);
+    }
+    else
+    {
+        rc = device_read(start_address, nblocks, buffer);
+    }
+    /*If the device failed return the negative number of failures*/
+    if (rc < 0)
+    {
+        return rc;
+    }
+
+    /*Return the number of blocks read*/
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a run of blocks, or stages it in write-back mode            */
+/*------------------------------------------------------------------*/
+static int write_run(int start_address, int nblocks, void *buffer)
+{
+    int i, rc;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || nblocks < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    /*In write-back mode the blocks are only staged until the next barrier*/
+    if (NULL != stage_data)
+    {
+        pthread_mutex_lock(&stage_lock);
+        for (i = 0; i < nblocks; i++)
+        {
+            if (stage_put(start_address + i, (char *)buffer + (size_t)i * BLOCK_SIZE) < 0)
+                break;
+        }
+        pthread_mutex_unlock(&stage_lock);
+        return i == nblocks ? nblocks : -1;
+    }
+
+    /*If the device failed return the negative number of failures*/
+    rc = device_write(start_address, nblocks, buffer);
+    if (rc < 0)
+    {
+        return rc;
+    }
+
+    /*Return the number of blocks written*/
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Transfers one run of segments addressing consecutive blocks with a */
+/*single device request, falling back to one request per segment if */
+/*the run fails so each segment gets its own status                  */
+/*------------------------------------------------------------------*/
+static int transfer_run(int write, block_iovec *iov, int n)
+{
+    struct iovec vec[n];
+    int i, failed = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        vec[i].iov_base = iov[i].buffer;
+        vec[i].iov_len = BLOCK_SIZE;
+    }
+    if (device_transfer(write, iov[0].block, n, vec, n) == 0)
+    {
+        for (i = 0; i < n; i++)
+            iov[i].status = 1;
+        return 0;
+    }
+    if (n == 1)
+    {
+        iov[0].status = -1;
+        return -1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        iov[i].status = device_transfer(write, iov[i].block, 1, &vec[i], 1) < 0 ? -1 : 1;
+        failed |= iov[i].status < 0;
+    }
+    return failed ? -1 : 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Runs a vectored request: neighbouring segments that address        */
+/*consecutive blocks are merged into one system call                 */
+/*------------------------------------------------------------------*/
+static int transfer_vector(int write, block_iovec *iov, int count)
+{
+    int i = 0, n, ok = 0;
+
+    while (i < count)
+    {
+        /*Segments outside the disk fail on their own*/
+        if (iov[i].block < 0 || iov[i].block >= MAX_BLOCK)
+        {
+            printf("out of bound error %d\n", iov[i].block);
+            iov[i].status = -1;
+            i++;
+            continue;
+        }
+
+        n = 1;
+        while (i + n < count && n < IOV_MAX
+               && iov[i + n].block == iov[i].block + n
+               && iov[i + n].block < MAX_BLOCK)
+        {
+            n++;
+        }
+
+        transfer_run(write, &iov[i], n);
+        i += n;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (iov[i].status > 0)
+            ok++;
+    }
+    return ok;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads a list of (block, buffer) segments                           */
+/*------------------------------------------------------------------*/
+int readv_blocks(block_iovec *iov, int count)
+{
+    struct timespec t0;
+    int i, ok;
+
+    stats_begin(&t0);
+    if (NULL == stage_data)
+    {
+        ok = transfer_vector(0, iov, count);
+        stats_end(0, count > 0 ? iov[0].block : 0, count, ok == count ? ok : -1, &t0);
+        return ok;
+    }
+
+    pthread_mutex_lock(&stage_lock);
+    ok = transfer_vector(0, iov, count);
+    for (i = 0; i < count && stage_count > 0; i++)
+    {
+        if (iov[i].status > 0)
+            stage_overlay(iov[i].block, 1, iov[i].buffer);
+    }
+    pthread_mutex_unlock(&stage_lock);
+    stats_end(0, count > 0 ? iov[0].block : 0, count, ok == count ? ok : -1, &t0);
+    return ok;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a list of (block, buffer) segments                          */
+/*------------------------------------------------------------------*/
+int writev_blocks(block_iovec *iov, int count)
+{
+    struct timespec t0;
+    int i, ok = 0;
+
+    stats_begin(&t0);
+    if (NULL == stage_data)
+    {
+        ok = transfer_vector(1, iov, count);
+        stats_end(1, count > 0 ? iov[0].block : 0, count, ok == count ? ok : -1, &t0);
+        return ok;
+    }
+
+    pthread_mutex_lock(&stage_lock);
+    for (i = 0; i < count; i++)
+    {
+        if (iov[i].block < 0 || iov[i].block >= MAX_BLOCK)
+        {
+            printf("out of bound error %d\n", iov[i].block);
+            iov[i].status = -1;
+            continue;
+        }
+        iov[i].status = stage_put(iov[i].block, iov[i].buffer) < 0 ? -1 : 1;
+        if (iov[i].status > 0)
+            ok++;
+    }
+    pthread_mutex_unlock(&stage_lock);
+    stats_end(1, count > 0 ? iov[0].block : 0, count, ok == count ? ok : -1, &t0);
+    return ok;
+}
+
+/*------------------------------------------------------------------*/
+/*Ordering point: every write issued before it reaches the image     */
+/*before any write issued after it                                   */
+/*------------------------------------------------------------------*/
+int barrier()
+{
+    int rc;
+
+    /*Queued requests were issued before the barrier, so they finish first*/
+    pthread_mutex_lock(&queue_lock);
+    while (inflight > 0)
+        pthread_cond_wait(&queue_done, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+
+    if (NULL == stage_data)
+        return 0;
+    pthread_mutex_lock(&stage_lock);
+    rc = stage_drain();
+    pthread_mutex_unlock(&stage_lock);
+    return rc;
+}
+
+/*------------------------------------------------------------------*/
+/*Tells the image a run of blocks no longer holds data. The range is */
+/*punched out of the file, so the host reclaims the space and later  */
+/*reads return 0's. Without hole punching support it is a no-op      */
+/*------------------------------------------------------------------*/
+int discard_blocks(int start_address, int nblocks)
+{
+    member *m;
+    int b, n, unit, mblock;
+
+    if (start_address < 0 || nblocks < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    /*Queued and staged writes to the range must not land after the punch*/
+    if (barrier() < 0)
+        return -1;
+    __atomic_fetch_add(&stats.discards, 1, __ATOMIC_RELAXED);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    /*Punch stripe unit by stripe unit, each in its own member image*/
+    for (b = start_address; b < start_address + nblocks; b += n)
+    {
+        unit = b / stripe_blocks;
+        n = stripe_blocks - b % stripe_blocks;
+        if (n > start_address + nblocks - b)
+            n = start_address + nblocks - b;
+        if (num_members == 1)
+        {
+            m = &members[0];
+            mblock = b;
+            n = start_address + nblocks - b;
+        }
+        else
+        {
+            m = &members[unit % num_members];
+            mblock = (unit / num_members) * stripe_blocks + b % stripe_blocks;
+        }
+        if (fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t)mblock * BLOCK_SIZE, (off_t)n * BLOCK_SIZE) < 0
+            && errno != EOPNOTSUPP)
+        {
+            return -1;
+        }
+    }
+#endif
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Durability point: drains staged writes and forces the image to     */
+/*stable storage                                                     */
+/*------------------------------------------------------------------*/
+int sync_disk()
+{
+    int rc = barrier();
+    int i;
+
+    __atomic_fetch_add(&stats.syncs, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < num_members; i++)
+    {
+        if (NULL != members[i].map)
+        {
+            if (msync(members[i].map, members[i].map_len, MS_SYNC) < 0)
+                rc = -1;
+        }
+        else if (fdatasync(members[i].fd) < 0)
+        {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+/*------------------------------------------------------------------*/
+/*Oldest queued request, or NULL; called with queue_lock held        */
+/*------------------------------------------------------------------*/
+static disk_request *next_queued()
+{
+    disk_request *oldest = NULL;
+    int i;
+
+    for (i = 0; i < QUEUE_DEPTH; i++)
+    {
+        if (queue[i].state == REQ_QUEUED && (NULL == oldest || queue[i].ticket < oldest->ticket))
+            oldest = &queue[i];
+    }
+    return oldest;
+}
+
+/*------------------------------------------------------------------*/
+/*Request holding a ticket, or NULL; called with queue_lock held     */
+/*------------------------------------------------------------------*/
+static disk_request *find_ticket(int ticket)
+{
+    int i;
+
+    for (i = 0; i < QUEUE_DEPTH; i++)
+    {
+        if (queue[i].state != REQ_FREE && queue[i].ticket == ticket)
+            return &queue[i];
+    }
+    return NULL;
+}
+
+/*------------------------------------------------------------------*/
+/*Worker thread: runs queued requests oldest first until stopped     */
+/*------------------------------------------------------------------*/
+static void *disk_worker(void *arg)
+{
+    disk_request *req;
+    int result;
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;)
+    {
+        while (NULL == (req = next_queued()) && !workers_stop)
+            pthread_cond_wait(&queue_work, &queue_lock);
+        if (NULL == req)
+            break;
+
+        req->state = REQ_RUNNING;
+        pthread_mutex_unlock(&queue_lock);
+
+        if (req->write)
+            result = write_blocks(req->start_address, req->nblocks, req->buffer);
+        else
+            result = read_blocks(req->start_address, req->nblocks, req->buffer);
+
+        pthread_mutex_lock(&queue_lock);
+        req->result = result;
+        req->state = REQ_DONE;
+        inflight--;
+        pthread_cond_broadcast(&queue_done);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+/*------------------------------------------------------------------*/
+/*Starts the worker pool on first use. SFS_DISK_WORKERS sets its     */
+/*size; 0 runs every request synchronously inside submit             */
+/*------------------------------------------------------------------*/
+static void start_workers()
+{
+    char *env = getenv("SFS_DISK_WORKERS");
+    int want = env != NULL ? atoi(env) : DEFAULT_WORKERS;
+
+    if (want < 0)
+        want = 0;
+    if (want > MAX_WORKERS)
+        want = MAX_WORKERS;
+
+    workers_stop = 0;
+    for (num_workers = 0; num_workers < want; num_workers++)
+    {
+        /*If threads are unavailable, fewer workers (or none) will do*/
+        if (pthread_create(&workers[num_workers], NULL, disk_worker, NULL) != 0)
+            break;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Stops and joins the worker pool; the queue must be idle            */
+/*------------------------------------------------------------------*/
+static void stop_workers()
+{
+    int i;
+
+    pthread_mutex_lock(&queue_lock);
+    workers_stop = 1;
+    pthread_cond_broadcast(&queue_work);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+    num_workers = -1;
+
+    /*Tickets that were never reaped die with the disk*/
+    memset(queue, 0, sizeof(queue));
+}
+
+/*------------------------------------------------------------------*/
+/*Queues a request and returns its ticket, or -1                     */
+/*------------------------------------------------------------------*/
+static int submit(int write, int start_address, int nblocks, void *buffer)
+{
+    disk_request *req = NULL;
+    int i, ticket;
+
+    pthread_mutex_lock(&queue_lock);
+    if (num_workers < 0)
+        start_workers();
+
+    for (;;)
+    {
+        for (i = 0; i < QUEUE_DEPTH && NULL == req; i++)
+        {
+            if (queue[i].state == REQ_FREE)
+                req = &queue[i];
+        }
+        /*A queue full of unreaped completions will never drain by itself*/
+        if (NULL != req || inflight == 0)
+            break;
+        pthread_cond_wait(&queue_done, &queue_lock);
+    }
+    if (NULL == req)
+    {
+        pthread_mutex_unlock(&queue_lock);
+        return -1;
+    }
+
+    ticket = next_ticket;
+    next_ticket = next_ticket == INT_MAX ? 1 : next_ticket + 1;
+    req->ticket = ticket;
+    req->write = write;
+    req->start_address = start_address;
+    req->nblocks = nblocks;
+    req->buffer = buffer;
+
+    if (num_workers == 0)
+    {
+        /*Synchronous fallback: the request completes before submit returns*/
+        req->state = REQ_RUNNING;
+        pthread_mutex_unlock(&queue_lock);
+        req->result = write ? write_blocks(start_address, nblocks, buffer)
+                            : read_blocks(start_address, nblocks, buffer);
+        pthread_mutex_lock(&queue_lock);
+        req->state = REQ_DONE;
+    }
+    else
+    {
+        req->state = REQ_QUEUED;
+        inflight++;
+        pthread_cond_signal(&queue_work);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return ticket;
+}
+
+/*------------------------------------------------------------------*/
+/*Queues an asynchronous read_blocks and returns its ticket          */
+/*------------------------------------------------------------------*/
+int submit_read(int start_address, int nblocks, void *buffer)
+{
+    return submit(0, start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------*/
+/*Queues an asynchronous write_blocks and returns its ticket         */
+/*------------------------------------------------------------------*/
+int submit_write(int start_address, int nblocks, void *buffer)
+{
+    return submit(1, start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------*/
+/*Checks a ticket without blocking. Returns 1 and reaps it with its  */
+/*result stored if it completed, 0 if still pending, -1 if unknown   */
+/*------------------------------------------------------------------*/
+int poll_disk(int ticket, int *result)
+{
+    disk_request *req;
+    int rc = -1;
+
+    pthread_mutex_lock(&queue_lock);
+    req = find_ticket(ticket);
+    if (NULL != req)
+    {
+        rc = 0;
+        if (req->state == REQ_DONE)
+        {
+            if (NULL != result)
+                *result = req->result;
+            req->state = REQ_FREE;
+            pthread_cond_broadcast(&queue_done);
+            rc = 1;
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return rc;
+}
+
+/*------------------------------------------------------------------*/
+/*Blocks until a ticket completes, reaps it and returns its result   */
+/*------------------------------------------------------------------*/
+int wait_disk(int ticket)
+{
+    disk_request *req;
+    int result = -1;
+
+    pthread_mutex_lock(&queue_lock);
+    req = find_ticket(ticket);
+    if (NULL != req)
+    {
+        while (req->state != REQ_DONE)
+            pthread_cond_wait(&queue_done, &queue_lock);
+        result = req->result;
+        req->state = REQ_FREE;
+        pthread_cond_broadcast(&queue_done);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return result;
+}
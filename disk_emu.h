@@ -1,5 +1,112 @@
+/*Block device backends, selected before init_disk/init_fresh_disk*/
+#define DISK_MODE_PREAD 0
+#define DISK_MODE_MMAP 1
+/*pread backend opened with O_DIRECT, bypassing the host page cache*/
+#define DISK_MODE_DIRECT 2
+/*
+ * Flag or'ed into the mode: writes are only buffered, and reach the image
+ * at barrier() and become durable at sync_disk()
+ */
+#define DISK_MODE_WRITEBACK 0x100
+/*
+ * Flag or'ed into the mode: init_fresh_disk reserves the image's space
+ * with fallocate instead of leaving the file sparse
+ */
+#define DISK_MODE_PREALLOC 0x200
+
+/*
+ * One segment of a vectored request: a single block and the buffer it
+ * is transferred to or from. status is set to 1 on success and -1 on
+ * failure. Segments addressing consecutive blocks that sit next to each
+ * other in the list are merged into one system call.
+ */
+typedef struct block_iovec {
+    int block;
+    void *buffer;
+    int status;
+} block_iovec;
+
+/*
+ * Device performance model charged to every request that reaches the
+ * image. A request pays latency_us, plus seek_us + seek_us_per_block per
+ * block of distance (capped at seek_max_us) unless it starts where the
+ * previous one ended, plus its size over bandwidth_mb (MB/s). At most
+ * queue_depth requests are served at once. Each attempt fails with
+ * probability failure_rate and is retried up to max_retry times. Zero
+ * disables a term.
+ */
+typedef struct disk_model {
+    double latency_us;
+    double seek_us;
+    double seek_us_per_block;
+    double seek_max_us;
+    double bandwidth_mb;
+    int queue_depth;
+    double failure_rate;
+    int max_retry;
+} disk_model;
+
+/*
+ * Buckets of the latency histograms: bucket i counts calls that took at
+ * least 2^(i-1) but less than 2^i microseconds, the last one the rest
+ */
+#define DISK_HIST_BUCKETS 32
+
+/*
+ * I/O statistics. reads/writes count read_blocks/write_blocks and
+ * readv_blocks/writev_blocks calls, with the blocks and bytes they moved.
+ * A call is sequential when it starts where the previous one ended.
+ * device_requests and device_blocks count what actually reached the
+ * image files after write-back staging and merging. Every field is an
+ * unsigned long long counter, so the counters can be read one by one.
+ */
+typedef struct disk_stats_t {
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long blocks_read;
+    unsigned long long blocks_written;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long sequential;
+    unsigned long long random;
+    unsigned long long errors;
+    unsigned long long device_requests;
+    unsigned long long device_blocks;
+    unsigned long long discards;
+    unsigned long long syncs;
+    unsigned long long read_latency[DISK_HIST_BUCKETS];
+    unsigned long long write_latency[DISK_HIST_BUCKETS];
+} disk_stats_t;
+
+void set_disk_mode(int mode);
+/*
+ * init_disk/init_fresh_disk accept a comma separated list of image files,
+ * e.g. "a.disk,b.disk". Block addresses are then striped over them, this
+ * many consecutive blocks per image (SFS_DISK_STRIPE, 16 by default).
+ */
+void set_disk_stripe(int blocks);
+/*Zeroed, page aligned memory for nblocks blocks, released with free()*/
+void *alloc_blocks(int nblocks);
+void set_disk_model(const disk_model *m);
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int readv_blocks(block_iovec *iov, int count);
+int writev_blocks(block_iovec *iov, int count);
+/*
+ * Asynchronous I/O: submit_* queue a request and return a ticket (or -1).
+ * A pool of worker threads serves the queue; SFS_DISK_WORKERS=0 makes
+ * each request complete synchronously inside submit. Every ticket must be
+ * reaped once with poll_disk or wait_disk, which report the value the
+ * matching read_blocks/write_blocks call returned.
+ */
+int submit_read(int start_address, int nblocks, void *buffer);
+int submit_write(int start_address, int nblocks, void *buffer);
+int poll_disk(int ticket, int *result);
+int wait_disk(int ticket);
+int discard_blocks(int start_address, int nblocks);
+void disk_stats(disk_stats_t *out, int reset);
+int barrier();
+int sync_disk();
 int close_disk();
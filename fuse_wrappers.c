@@ -167,6 +167,11 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     return 0;
 }
 
+static void fuse_destroy(void *private_data)
+{
+    sfs_sync();
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
@@ -178,6 +183,7 @@ static struct fuse_operations xmp_oper = {
     .write = fuse_write, 
     .access = fuse_access,
     .create = fuse_create,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
@@ -6,99 +6,551 @@
 #include <string.h>
 #include <fuse.h>
 #include <strings.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
 #include "disk_emu.h"
+#include "block_cache.h"
 #define diskName "sfs_disk.disk"
 
 
 /* macros */
-#define FREE_BIT(_data, _which_bit) \
-    _data = _data | (1 << _which_bit)
-
-#define USE_BIT(_data, _which_bit) \
-    _data = _data & ~(1 << _which_bit)
-
 #define FALSE 0
 #define TRUE 1
 
+//returned when a file block is not mapped to a disk block
+#define NO_BLOCK UINT32_MAX
+#define EXTENT_MAGIC 0x45585431
+
+#define SFS_MAGIC 0xACBD0005
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_HEADER 1
+#define JOURNAL_DESCRIPTOR 2
+#define JOURNAL_COMMIT 3
+
+//readahead window bounds in blocks; the window doubles while reads stay sequential
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 32
+
+//group commit defaults, overridden by SFS_COMMIT_OPS and SFS_COMMIT_MS; 1 op commits every call
+#define COMMIT_MAX_OPS 32
+#define COMMIT_MAX_MS 500
+
+//journal length as a fraction of the disk, between DEFAULT_JOURNAL_BLOCKS and JOURNAL_MAX_BLOCKS
+#define JOURNAL_DISK_FRACTION 256
+#define JOURNAL_MAX_BLOCKS 1024
+//metadata blocks read with the superblock in one request at mount; the tables past them load on first use
+#define MOUNT_HEAD_BLOCKS 64
+
+
+//state of each metadata block, indexed from inode_table_index
+#define METADATA_DIRTY 1	//changed in memory since the last commit
+#define METADATA_LOADED 2	//copied into the tables since mount; the rest load on first use
+#define METADATA_LOGGED 4	//logged by the journal but not yet written to its home location
 
-//initialize all bits to high
-uint8_t free_bit_map[BITMAP_ROW_SIZE] = { [0 ... BITMAP_ROW_SIZE - 1] = UINT8_MAX };
+//bytes each table takes on disk
+#define INODE_TABLE_BYTES ((size_t)max_inode_number*sizeof(inode_t))
+#define ROOT_DIRECTORY_BYTES ((size_t)max_inode_number*sizeof(directory_entry))
+#define BITMAP_BYTES ((size_t)(number_of_blocks + 7)/8)
 
 /***********************************************************************************
 * 							Global variables/data structures
 ************************************************************************************/
-file_descriptor fileDescriptorTable[max_inode_number];
-directory_entry rootDirectory[max_inode_number];
-inode_t inodeTable[max_inode_number]; 
+//geometry of the mounted disk, from its superblock
+int block_size = DEFAULT_BLOCK_SIZE;
+int number_of_blocks = DEFAULT_NUM_BLOCKS;
+int max_inode_number = DEFAULT_NUM_INODES;
+int pointers_per_block = DEFAULT_BLOCK_SIZE/sizeof(unsigned int);	//entries in an indirect block
+uint32_t root_directory_index;
+uint32_t bitmap_index;
+uint32_t journal_index;
+uint32_t journal_blocks;
+uint32_t data_block_index;
+uint32_t metadata_blocks;	//inode table, root directory and bitmap blocks, the blocks the journal logs
+int inodeFormat = FORMAT_POINTERS;
+//geometry for the next mksfs(1)
+sfs_geometry formatGeometry = { 0, 0, 0 };
+
+//tables sized by the geometry; the bitmap (free_bit_map) is kept by bitmap.c
+file_descriptor *fileDescriptorTable = NULL;
+directory_entry *rootDirectory = NULL;
+inode_t *inodeTable = NULL;
+int bitmapLoaded = FALSE;	//every bitmap block is loaded and bitmap.c has counted it
+uint8_t *metadataState = NULL;
 superblock_t *superblock = NULL;
 int nextFileCounter = 0;
 int count = 0;
 void *temp;
+//the open group commit: operations since the last commit, when the first of them ran,
+//and blocks they freed, released and discarded by the commit that records them as free
+int commitOps = 0;
+long long commitStartMs = 0;
+int commitMaxOps = COMMIT_MAX_OPS;
+int commitMaxMs = COMMIT_MAX_MS;
+unsigned int *pendingDiscards = NULL;
+int pendingDiscardCount = 0;
+//journal state; images formatted before the journal existed are used without one
+int journalEnabled = FALSE;
+uint32_t journalStart = 1;		//log block where the oldest transaction not yet checkpointed begins
+uint32_t journalHead = 1;		//log block the next transaction is written at
+uint64_t journalSequence = 1;	//sequence number of the next transaction
+//every API call holds apiLock, which the commit thread takes to close a transaction left open past commitMaxMs
+pthread_mutex_t apiLock;
+pthread_once_t apiOnce = PTHREAD_ONCE_INIT;
+int mounted = FALSE;
+
+void markDirty(uint32_t table, size_t offset, size_t length);
+void discardBlocks(unsigned int *blocks, int n);
+int loadBitmap();
 
 /**********************************************************************************
 * 								Bitmap methods
 ***********************************************************************************/
-void force_set_index(uint32_t index) {
-    // Used to force indicies to used 
-    // this is the opposite of rm_index. 
-    uint32_t i = index / 8;
+//the allocator in bitmap.c reports each bitmap byte it changes, to be written with the next commit
+void bitmapChanged(uint32_t byte){
+	markDirty(bitmap_index,byte,1);
+}
 
-    // get which bit to set to used
-    uint8_t bit = index % 8;
+/********************************************************************************
+* 								Size calculation methods
+*********************************************************************************/
+int calculateNumberOfBlocksNeeded(size_t input) { // calculate how many blocks needed
+    int result = (input + (block_size-1))/block_size;
 
-    // set bit to used
-    USE_BIT(free_bit_map[i], bit);
+    return result;
 }
 
-uint32_t get_index() {
-    uint32_t i = 0;
+int calculateSizeNeeded(size_t input) { //calculate size to store in blocks
+    int x = calculateNumberOfBlocksNeeded(input);
+    int result = x * block_size;
+    return result;
+}
 
-    // find the first section with a free bit
-    // let's ignore overflow for now...
-    while (free_bit_map[i] == 0) { i++; }
+/********************************************************************************
+* 								Metadata load methods
+*********************************************************************************/
+int metadataBlock(uint32_t block, char **source, size_t *length);
+
+//copy metadata blocks [first, first+n) into the tables unless they already are; each missing run is one read
+int loadMetadata(uint32_t first, int n){
+	char *source;
+	size_t length;
+	uint32_t block = first;
+	while(block < first + n){
+		if((metadataState[block - inode_table_index] & METADATA_LOADED) != 0){
+			block++;
+			continue;
+		}
+		uint32_t runStart = block;
+		while(block < first + n && (metadataState[block - inode_table_index] & METADATA_LOADED) == 0){
+			block++;
+		}
+		char *buffer = alloc_blocks(block - runStart);
+		if(cache_read_blocks(runStart,block - runStart,buffer) < 0){
+			// printf("Error reading metadata\n");
+			free(buffer);
+			return -1;
+		}
+		for(uint32_t b=runStart;b<block;b++){
+			if(metadataBlock(b,&source,&length)){
+				memcpy(source,buffer + (size_t)(b - runStart)*block_size,length);
+			}
+			metadataState[b - inode_table_index] |= METADATA_LOADED;
+		}
+		free(buffer);
+	}
+	return 0;
+}
 
-    // now, find the first free bit
-    /*
-        The ffs() function returns the position of the first (least
-       significant) bit set in the word i.  The least significant bit is
-       position 1 and the most significant position is, for example, 32 or
-       64.  
-    */
-    // Since ffs has the lsb as 1, not 0. So we need to subtract
-    uint8_t bit = ffs(free_bit_map[i]) - 1;
+//load the inode table block(s) holding one inode
+int loadInode(int inode){
+	size_t offset = (size_t)inode*sizeof(inode_t);
+	int first = offset/block_size;
+	int last = (offset + sizeof(inode_t) - 1)/block_size;
+	return loadMetadata(inode_table_index + first,last - first + 1);
+}
 
-    // set the bit to used
-    USE_BIT(free_bit_map[i], bit);
+int loadInodeTable(){
+	return loadMetadata(inode_table_index,calculateNumberOfBlocksNeeded(INODE_TABLE_BYTES));
+}
 
-    //return which block we used
-    return i*8 + bit;
+int loadDirectory(){
+	return loadMetadata(root_directory_index,calculateNumberOfBlocksNeeded(ROOT_DIRECTORY_BYTES));
 }
 
-void rm_index(uint32_t index) {
+//called before every allocation, so after the first load it only checks a flag
+int loadBitmap(){
+	if(bitmapLoaded){
+		return 0;
+	}
+	if(loadMetadata(bitmap_index,calculateNumberOfBlocksNeeded(BITMAP_BYTES)) < 0){
+		return -1;
+	}
+	rebuild_bitmap_summary();
+	bitmapLoaded = TRUE;
+	return 0;
+}
+
+/********************************************************************************
+* 								Metadata flush methods
+*********************************************************************************/
+//mark the blocks holding bytes [offset, offset+length) of the table starting at block table as changed
+void markDirty(uint32_t table, size_t offset, size_t length){
+	for(size_t b = offset/block_size; b <= (offset+length-1)/block_size; b++){
+		metadataState[table - inode_table_index + b] |= METADATA_DIRTY;
+	}
+}
 
-    // get index in array of which bit to free
-    uint32_t i = index / 8;
+void markInodeDirty(int inode){
+	markDirty(inode_table_index,inode*sizeof(inode_t),sizeof(inode_t));
+}
 
-    // get which bit to free
-    uint8_t bit = index % 8;
+void markDirectoryEntryDirty(int entry){
+	markDirty(root_directory_index,entry*sizeof(directory_entry),sizeof(directory_entry));
+}
 
-    // free bit
-    FREE_BIT(free_bit_map[i], bit);
+//find which table an on-disk block belongs to; returns the bytes of that block held in memory
+int metadataBlock(uint32_t block, char **source, size_t *length){
+	const struct { uint32_t start; void *table; size_t size; } tables[] = {
+		{ inode_table_index, inodeTable, INODE_TABLE_BYTES },
+		{ root_directory_index, rootDirectory, ROOT_DIRECTORY_BYTES },
+		{ bitmap_index, free_bit_map, BITMAP_BYTES },
+	};
+	for(int t=0;t<3;t++){
+		uint32_t first = tables[t].start;
+		if(block >= first && block < first + calculateNumberOfBlocksNeeded(tables[t].size)){
+			size_t offset = (size_t)(block - first)*block_size;
+			*source = (char *)tables[t].table + offset;
+			*length = tables[t].size - offset < block_size ? tables[t].size - offset : block_size;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+//list the metadata blocks in any of the given states, in disk order
+int metadataBlocks(uint8_t state, uint32_t *blocks){
+	int n = 0;
+	for(uint32_t block=inode_table_index; block<journal_index; block++){
+		if((metadataState[block - inode_table_index] & state) != 0){
+			blocks[n++] = block;
+		}
+	}
+	return n;
+}
+
+void clearMetadata(uint8_t state){
+	for(uint32_t i=0;i<metadata_blocks;i++){
+		metadataState[i] &= ~state;
+	}
+}
+
+//copy the in-memory contents of metadata blocks into buffer, one block each, with their home locations in iov
+void gatherMetadata(const uint32_t *blocks, int n, char *buffer, block_iovec *iov){
+	char *source;
+	size_t length;
+	for(int i=0;i<n;i++){
+		iov[i].block = blocks[i];
+		iov[i].buffer = buffer + (size_t)i*block_size;
+		iov[i].status = 0;
+		if(metadataBlock(blocks[i],&source,&length)){
+			memcpy(iov[i].buffer,source,length);
+		}
+	}
+}
+
+//write the metadata blocks in a state to their home locations with one vectored write; adjacent blocks become single requests
+int writeMetadata(uint8_t state){
+	uint32_t *blocks = malloc(metadata_blocks*sizeof(uint32_t));
+	int n = metadataBlocks(state,blocks);
+	if(n == 0){
+		free(blocks);
+		return 0;
+	}
+	block_iovec *iov = malloc(n*sizeof(block_iovec));
+	char *buffer = alloc_blocks(n);
+	gatherMetadata(blocks,n,buffer,iov);
+	int written = cache_writev_blocks(iov,n);
+	free(buffer);
+	free(iov);
+	free(blocks);
+	if(written < n){
+		// printf("Error writing metadata\n");
+		return -1;
+	}
+	return 0;
+}
+
+int journalCommit();
+
+//write every changed metadata block, through the journal when the disk has one
+int flushMetadata(){
+	if(journalEnabled){
+		return journalCommit();
+	}
+	if(writeMetadata(METADATA_DIRTY) < 0){
+		return -1;
+	}
+	clearMetadata(METADATA_DIRTY);
+	return 0;
+}
+
+long long nowMs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+//order the writes made so far before the ones that follow; with write-back those may still be in the cache,
+//and only cache_flush orders cached writes
+int writeBarrier(){
+	if(cache_flush() < 0){
+		return -1;
+	}
+	return barrier();
+}
+
+//close the open transaction: data before metadata, then the metadata in one write, then discards
+int commitMetadata(){
+	//data blocks must reach the disk before the metadata that points at them
+	if(writeBarrier() < 0){
+		return -1;
+	}
+	//blocks removed files used are freed only by the commit that records the removal, so until
+	//it is on disk nothing can be written over blocks the disk still gives to those files
+	for(int i=0;i<pendingDiscardCount;i++){
+		rm_index(pendingDiscards[i]);
+	}
+	if(flushMetadata() < 0){
+		return -1;
+	}
+	//and the commit recording the blocks as free before they are punched out
+	if(pendingDiscardCount > 0 && writeBarrier() < 0){
+		return -1;
+	}
+	discardBlocks(pendingDiscards,pendingDiscardCount);
+	pendingDiscardCount = 0;
+	commitOps = 0;
+	return 0;
+}
+
+//end of a metadata changing call; commits once enough calls or time have gathered
+int endOperation(){
+	if(commitOps++ == 0){
+		commitStartMs = nowMs();
+	}
+	if(commitOps >= commitMaxOps || nowMs() - commitStartMs >= commitMaxMs){
+		return commitMetadata();
+	}
+	return 0;
+}
+
+//read a positive setting, such as a group commit threshold, from the environment
+int envSetting(const char *name, int fallback){
+	char *value = getenv(name);
+	if(value == NULL || atoi(value) < 1){
+		return fallback;
+	}
+	return atoi(value);
 }
 
 /********************************************************************************
-* 								Size calculation methods
+* 								Journal methods
 *********************************************************************************/
-int calculateNumberOfBlocksNeeded(size_t input) { // calculate how many blocks needed
-    int result = (input + (BLOCK_SIZE-1))/BLOCK_SIZE;
+//log blocks are numbered 1 to journal_blocks-1 from journal_index and wrap around
+uint32_t journalNext(uint32_t position){
+	return position + 1 < journal_blocks ? position + 1 : 1;
+}
 
-    return result;
+int journalFree(){
+	int used = (journalHead + (journal_blocks - 1) - journalStart) % (journal_blocks - 1);
+	return (journal_blocks - 1) - used - 1;
 }
 
-int calculateSizeNeeded(size_t input) { //calculate size to store in blocks
-    int x = calculateNumberOfBlocksNeeded(input);
-    int result = x * BLOCK_SIZE;
-    return result;
+//home locations one descriptor block can list
+int journalCapacity(){
+	return (block_size - sizeof(journal_block_t))/sizeof(uint32_t);
+}
+
+//log blocks kept free for the next transaction; a commit leaving fewer checkpoints
+int journalReserve(){
+	uint32_t blocks = metadata_blocks < (journal_blocks - 2)/2 ? metadata_blocks : (journal_blocks - 2)/2;
+	return blocks + 2;
+}
+
+uint32_t journalChecksum(const char *data, size_t length){
+	uint32_t hash = 2166136261u;
+	for(size_t i=0;i<length;i++){
+		hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+int writeJournalHeader(){
+	journal_block_t *header = alloc_blocks(1);
+	header->magic = JOURNAL_MAGIC;
+	header->type = JOURNAL_HEADER;
+	header->sequence = journalSequence;
+	header->start = journalStart;
+	int written = cache_write_blocks(journal_index,1,header);
+	free(header);
+	return written < 0 ? -1 : 0;
+}
+
+//copy every logged block to its home location and empty the log
+int journalCheckpoint(){
+	//the log must be on disk before the home locations change, and they before the log is dropped
+	if(writeBarrier() < 0 || writeMetadata(METADATA_LOGGED) < 0 || writeBarrier() < 0){
+		return -1;
+	}
+	clearMetadata(METADATA_LOGGED);
+	journalStart = journalHead;
+	return writeJournalHeader();
+}
+
+//log the changed metadata blocks as one transaction: descriptor, block copies and commit block in one write
+int journalCommit(){
+	uint32_t *blocks = malloc(metadata_blocks*sizeof(uint32_t));
+	int n = metadataBlocks(METADATA_DIRTY,blocks);
+	if(n == 0){
+		free(blocks);
+		return 0;
+	}
+	//a transaction too big for the log goes straight home behind a checkpoint, and only it is not atomic
+	if(n > journalCapacity() || n + 2 > journalFree()){
+		free(blocks);
+		if(journalCheckpoint() < 0 || writeMetadata(METADATA_DIRTY) < 0){
+			return -1;
+		}
+		clearMetadata(METADATA_DIRTY);
+		return 0;
+	}
+	block_iovec *iov = malloc((n + 2)*sizeof(block_iovec));
+	char *buffer = alloc_blocks(n + 2);
+	gatherMetadata(blocks,n,buffer + block_size,iov + 1);
+	free(blocks);
+
+	journal_block_t *descriptor = (journal_block_t *)buffer;
+	journal_block_t *commit = (journal_block_t *)(buffer + (size_t)(n + 1)*block_size);
+	descriptor->magic = commit->magic = JOURNAL_MAGIC;
+	descriptor->type = JOURNAL_DESCRIPTOR;
+	commit->type = JOURNAL_COMMIT;
+	descriptor->sequence = commit->sequence = journalSequence;
+	descriptor->count = commit->count = n;
+	commit->checksum = journalChecksum(buffer + block_size,(size_t)n*block_size);
+	iov[0].buffer = descriptor;
+	iov[n + 1].buffer = commit;
+
+	//the log records where each block lives, and the write itself goes to the log
+	uint32_t position = journalHead;
+	for(int i=0;i<n + 2;i++){
+		if(i >= 1 && i <= n){
+			descriptor->home[i - 1] = iov[i].block;
+		}
+		iov[i].block = journal_index + position;
+		iov[i].status = 0;
+		position = journalNext(position);
+	}
+	int written = cache_writev_blocks(iov,n + 2);
+	free(buffer);
+	free(iov);
+	if(written < n + 2){
+		// printf("Error writing journal\n");
+		return -1;
+	}
+
+	journalHead = position;
+	journalSequence++;
+	for(uint32_t i=0;i<metadata_blocks;i++){
+		if((metadataState[i] & METADATA_DIRTY) != 0){
+			metadataState[i] = (metadataState[i] & ~METADATA_DIRTY) | METADATA_LOGGED;
+		}
+	}
+	//checkpoint lazily, once the next transaction might not fit; the tables in memory match the log here
+	if(journalFree() < journalReserve()){
+		return journalCheckpoint();
+	}
+	return 0;
+}
+
+//start an empty log on a freshly formatted disk
+int journalFormat(){
+	journalEnabled = TRUE;
+	journalStart = journalHead = 1;
+	journalSequence = 1;
+	clearMetadata(METADATA_LOGGED);
+	return writeJournalHeader();
+}
+
+//copy committed transactions from the log to their home locations; only the tail since the last checkpoint is read
+int journalReplay(){
+	journal_block_t *block = alloc_blocks(1);
+	char *logged = alloc_blocks(journal_blocks);
+	uint32_t *homes = malloc(journalCapacity()*sizeof(uint32_t));
+	int replayed = 0;
+
+	journalEnabled = FALSE;
+	if(cache_read_blocks(journal_index,1,block) < 0 || block->magic != JOURNAL_MAGIC || block->type != JOURNAL_HEADER
+		|| block->start < 1 || block->start >= journal_blocks){
+		free(block);
+		free(logged);
+		free(homes);
+		return -1;
+	}
+	journalEnabled = TRUE;
+	journalStart = block->start;
+	journalSequence = block->sequence;
+	clearMetadata(METADATA_LOGGED);
+
+	uint32_t position = journalStart;
+	while(TRUE){
+		//a transaction counts only if its descriptor, every block and a matching commit block made it to disk
+		uint32_t next = position;
+		if(cache_read_blocks(journal_index + next,1,block) < 0 || block->magic != JOURNAL_MAGIC
+			|| block->type != JOURNAL_DESCRIPTOR || block->sequence != journalSequence || block->count > journalCapacity() || block->count + 4 > journal_blocks){
+			break;
+		}
+		int n = block->count;
+		memcpy(homes,block->home,n*sizeof(uint32_t));
+		int complete = TRUE;
+		for(int i=0;i<n && complete;i++){
+			next = journalNext(next);
+			complete = cache_read_blocks(journal_index + next,1,logged + (size_t)i*block_size) >= 0
+				&& homes[i] >= inode_table_index && homes[i] < journal_index;
+		}
+		next = journalNext(next);
+		if(!complete || cache_read_blocks(journal_index + next,1,block) < 0 || block->magic != JOURNAL_MAGIC
+			|| block->type != JOURNAL_COMMIT || block->sequence != journalSequence
+			|| block->checksum != journalChecksum(logged,(size_t)n*block_size)){
+			break;
+		}
+
+		for(int i=0;i<n;i++){
+			if(cache_write_blocks(homes[i],1,logged + (size_t)i*block_size) < 0){
+				free(block);
+				free(logged);
+				free(homes);
+				return -1;
+			}
+		}
+		position = journalNext(next);
+		journalSequence++;
+		replayed++;
+	}
+	free(block);
+	free(logged);
+	free(homes);
+
+	journalHead = position;
+	if(replayed > 0){
+		//the replayed blocks are home now, so the log can start over behind them
+		if(writeBarrier() < 0){
+			return -1;
+		}
+		journalStart = journalHead;
+		return writeJournalHeader();
+	}
+	return 0;
 }
 
 /*********************************************************************************
@@ -110,20 +562,105 @@ void init_fdt(){
 	}
 }
 
+//drop the copy of a mapping block an open file keeps
+void releaseMapping(file_descriptor *fd){
+	free(fd->mapData);
+	fd->mapData = NULL;
+	fd->mapCached = NO_BLOCK;
+}
+
+//an unused inode maps no blocks
+void init_inode(inode_t *inode){
+	memset(inode,0,sizeof(inode_t));
+	inode->size = -1;
+	if(inodeFormat == FORMAT_POINTERS){
+		for(int i=0;i<12;i++){
+			inode->data_ptrs[i] = -1;
+		}
+		inode->indirectPointer = -1;
+	}
+}
+
 void init_int(){
 	for(int i=0; i<max_inode_number; i++){
-		inodeTable[i].size = -1;
-		inodeTable[i].indirectPointer = -1;
+		init_inode(&inodeTable[i]);
 	}
 }
 
-void init_super(){
+//place the root directory, bitmap, journal and data blocks one after another behind the inode table
+void layoutSuperblock(superblock_t *sb, uint64_t journalBlocks){
+	uint64_t size = sb->block_size;
+	sb->root_directory_index = inode_table_index + (sb->inode_table_len*sizeof(inode_t) + size - 1)/size;
+	sb->bitmap_index = sb->root_directory_index + (sb->inode_table_len*sizeof(directory_entry) + size - 1)/size;
+	sb->journal_index = sb->bitmap_index + ((sb->fs_size + 7)/8 + size - 1)/size;
+	sb->journal_blocks = journalBlocks;
+	sb->data_block_index = sb->journal_index + journalBlocks;
+}
+
+void init_super(int blockSize, int blocks, int inodes){
+	free(superblock);
 	superblock = calloc(1, sizeof(superblock_t));
-		superblock->magic = 0xACBD0005;
-		superblock->block_size = BLOCK_SIZE;
-		superblock->fs_size = number_of_blocks;
-		superblock->inode_table_len = 100;
+		superblock->magic = SFS_MAGIC;
+		superblock->block_size = blockSize;
+		superblock->fs_size = blocks;
+		superblock->inode_table_len = inodes;
 		superblock->root_dir_inode = 0;
+		superblock->format = FORMAT_EXTENTS;
+		//the log grows with the disk so larger commits still fit in it
+		uint64_t journalBlocks = blocks/JOURNAL_DISK_FRACTION;
+		if(journalBlocks < DEFAULT_JOURNAL_BLOCKS){
+			journalBlocks = DEFAULT_JOURNAL_BLOCKS;
+		}
+		if(journalBlocks > JOURNAL_MAX_BLOCKS){
+			journalBlocks = JOURNAL_MAX_BLOCKS;
+		}
+		layoutSuperblock(superblock,journalBlocks);
+}
+
+//take the geometry of a superblock and size the tables for it; -1 if it does not describe a usable disk
+int useGeometry(const superblock_t *sb){
+	superblock_t expected = *sb;
+	layoutSuperblock(&expected,sb->journal_blocks);
+	if(sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE || (sb->block_size & (sb->block_size - 1)) != 0
+		|| sb->inode_table_len < 1 || sb->inode_table_len > INT32_MAX/sizeof(inode_t) || sb->fs_size > INT32_MAX
+		|| memcmp(&expected,sb,sizeof(superblock_t)) != 0 || sb->data_block_index >= sb->fs_size
+		|| (sb->journal_blocks != 0 && sb->journal_blocks < 8) || sb->format > FORMAT_EXTENTS){
+		return -1;
+	}
+	//copies of mapping blocks kept by files still open go with the old table
+	for(int i=0;fileDescriptorTable != NULL && i<max_inode_number;i++){
+		releaseMapping(&fileDescriptorTable[i]);
+	}
+	inodeFormat = sb->format == FORMAT_EXTENTS ? FORMAT_EXTENTS : FORMAT_POINTERS;
+	block_size = sb->block_size;
+	number_of_blocks = sb->fs_size;
+	max_inode_number = sb->inode_table_len;
+	pointers_per_block = block_size/sizeof(unsigned int);
+	root_directory_index = sb->root_directory_index;
+	bitmap_index = sb->bitmap_index;
+	journal_index = sb->journal_index;
+	journal_blocks = sb->journal_blocks;
+	data_block_index = sb->data_block_index;
+	metadata_blocks = journal_index - inode_table_index;
+
+	free(fileDescriptorTable);
+	free(rootDirectory);
+	free(inodeTable);
+	free(metadataState);
+	free(pendingDiscards);
+	fileDescriptorTable = calloc(max_inode_number,sizeof(file_descriptor));
+	rootDirectory = calloc(max_inode_number,sizeof(directory_entry));
+	inodeTable = calloc(max_inode_number,sizeof(inode_t));
+	bitmapLoaded = FALSE;
+	set_bitmap_hooks(loadBitmap,bitmapChanged);
+	metadataState = calloc(metadata_blocks,1);
+	pendingDiscards = malloc(number_of_blocks*sizeof(unsigned int));
+	//all blocks start free; the padding to a whole word stays used
+	if(fileDescriptorTable == NULL || rootDirectory == NULL || inodeTable == NULL || init_bitmap(number_of_blocks) < 0
+		|| metadataState == NULL || pendingDiscards == NULL){
+		return -1;
+	}
+	return 0;
 }
 
 void init_root(){
@@ -132,6 +669,358 @@ void init_root(){
 	}
 }
 
+/*********************************************************************************
+*							File block mapping methods
+**********************************************************************************/
+//extent tree entries one node block holds
+int extentsPerNode(){
+	return (block_size - sizeof(extent_node_t))/sizeof(extent_t);
+}
+
+//most blocks a file can map; extents are bounded by the 32-bit size in the inode
+uint32_t maxFileBlocks(){
+	return inodeFormat == FORMAT_EXTENTS ? UINT32_MAX/block_size : 12 + pointers_per_block;
+}
+
+//read a mapping block, unless only cached ones may be read and it is not; then it is reported in *uncached
+int readMappingBlock(uint32_t block, void *buffer, uint32_t *uncached){
+	if(uncached != NULL && !cache_contains(block)){
+		*uncached = block;
+		return -1;
+	}
+	return cache_read_blocks(block,1,buffer) < 0 ? -1 : 0;
+}
+
+//the copy an open file keeps of a mapping block, NULL if it keeps another one
+const void *keptMapping(file_descriptor *fd, uint32_t block){
+	return fd != NULL && fd->mapData != NULL && fd->mapCached == block ? fd->mapData : NULL;
+}
+
+void keepMapping(file_descriptor *fd, uint32_t block, const void *data){
+	if(fd == NULL){
+		return;
+	}
+	if(fd->mapData == NULL){
+		fd->mapData = malloc(block_size);
+		if(fd->mapData == NULL){
+			return;
+		}
+	}
+	memcpy(fd->mapData,data,block_size);
+	fd->mapCached = block;
+}
+
+uint32_t mapPointer(inode_t *inode, uint32_t block, uint32_t *run, uint32_t *uncached, file_descriptor *fd){
+	uint32_t mapped = calculateNumberOfBlocksNeeded(inode->size);
+	if(mapped > maxFileBlocks()){
+		mapped = maxFileBlocks();
+	}
+	if(block >= mapped){
+		return NO_BLOCK;
+	}
+	const unsigned int *indirect = NULL;
+	unsigned int *buffer = NULL;
+	if(mapped > 12){
+		indirect = keptMapping(fd,inode->indirectPointer);
+		if(indirect == NULL){
+			buffer = alloc_blocks(1);
+			if(readMappingBlock(inode->indirectPointer,buffer,uncached) < 0){
+				free(buffer);
+				buffer = NULL;
+				//the direct blocks can still be mapped
+				if(block >= 12){
+					return NO_BLOCK;
+				}
+				mapped = 12;
+			}
+			else{
+				keepMapping(fd,inode->indirectPointer,buffer);
+				indirect = buffer;
+			}
+		}
+	}
+	uint32_t physical = block < 12 ? inode->data_ptrs[block] : indirect[block - 12];
+	//count the pointers after it that go on where it left off
+	for(uint32_t i = block; i < mapped; i++){
+		uint32_t next = i < 12 ? inode->data_ptrs[i] : indirect[i - 12];
+		if(next != physical + (i - block)){
+			break;
+		}
+		(*run)++;
+	}
+	free(buffer);
+	return physical;
+}
+
+//entry of a sorted extent list covering a logical block: the last one starting at or before it, -1 if none
+int findExtent(const extent_t *entries, int count, uint32_t block){
+	int low = 0;
+	int high = count - 1;
+	int found = -1;
+	while(low <= high){
+		int middle = (low + high)/2;
+		if(entries[middle].logical <= block){
+			found = middle;
+			low = middle + 1;
+		}
+		else{
+			high = middle - 1;
+		}
+	}
+	return found;
+}
+
+//disk block holding file block `block`, NO_BLOCK if it is not mapped; *run is set to how many file blocks from it on
+//follow it on disk. With uncached set, mapping blocks are only read from the cache and the first missing one is reported there.
+//With fd set, the last indirect block or extent leaf used is kept with the open file and read from there next time
+uint32_t mapBlock(inode_t *inode, uint32_t block, uint32_t *run, uint32_t *uncached, file_descriptor *fd){
+	*run = 0;
+	if(inodeFormat == FORMAT_POINTERS){
+		return mapPointer(inode,block,run,uncached,fd);
+	}
+	//a kept leaf maps the block if one of its extents covers it; otherwise the tree is walked from the root
+	const extent_node_t *kept = fd != NULL ? keptMapping(fd,fd->mapCached) : NULL;
+	if(kept != NULL && kept->magic == EXTENT_MAGIC && kept->depth == 0){
+		int i = findExtent(kept->entries,kept->count,block);
+		if(i >= 0 && block - kept->entries[i].logical < kept->entries[i].length){
+			*run = kept->entries[i].length - (block - kept->entries[i].logical);
+			return kept->entries[i].physical + (block - kept->entries[i].logical);
+		}
+	}
+	const extent_t *entries = inode->extents;
+	int count = inode->extentCount;
+	int depth = inode->extentDepth;
+	extent_node_t *node = NULL;
+	uint32_t physical = NO_BLOCK;
+	while(TRUE){
+		int i = findExtent(entries,count,block);
+		if(i < 0){
+			break;
+		}
+		if(depth == 0){
+			if(block - entries[i].logical < entries[i].length){
+				physical = entries[i].physical + (block - entries[i].logical);
+				*run = entries[i].length - (block - entries[i].logical);
+			}
+			break;
+		}
+		if(node == NULL){
+			node = alloc_blocks(1);
+		}
+		uint32_t child = entries[i].physical;
+		if(readMappingBlock(child,node,uncached) < 0 || node->magic != EXTENT_MAGIC || node->depth != depth - 1){
+			break;
+		}
+		if(node->depth == 0){
+			keepMapping(fd,child,node);
+		}
+		entries = node->entries;
+		count = node->count;
+		depth = node->depth;
+	}
+	free(node);
+	return physical;
+}
+
+int appendPointers(inode_t *inode, uint32_t block, uint32_t physical, uint32_t n){
+	if(block + n > maxFileBlocks()){
+		return -1;
+	}
+	unsigned int *indirect = NULL;
+	for(uint32_t i=0;i<n;i++){
+		if(block + i < 12){
+			inode->data_ptrs[block + i] = physical + i;
+			continue;
+		}
+		if(indirect == NULL){
+			indirect = alloc_blocks(1);
+			//the indirect block is taken when the first block past data_ptrs[11] is
+			if(inode->indirectPointer == -1){
+				uint32_t table = get_index();
+				if(table == BITMAP_FULL){
+					free(indirect);
+					return -1;
+				}
+				inode->indirectPointer = table;
+				memset(indirect,UINT8_MAX,block_size);
+			}
+			else if(cache_read_blocks(inode->indirectPointer,1,indirect) < 0){
+				free(indirect);
+				return -1;
+			}
+		}
+		indirect[block + i - 12] = physical + i;
+	}
+	if(indirect != NULL){
+		int written = cache_write_blocks(inode->indirectPointer,1,indirect);
+		free(indirect);
+		if(written < 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//build tree nodes from depth down to a leaf, each holding one entry, that map e; returns the top one
+uint32_t newBranch(int depth, const extent_t *e){
+	if(free_block_count() < (uint32_t)depth + 1){
+		return NO_BLOCK;
+	}
+	extent_node_t *node = alloc_blocks(1);
+	uint32_t block = NO_BLOCK;
+	for(int d=0;d<=depth;d++){
+		uint32_t below = block;
+		block = get_index();
+		memset(node,0,block_size);
+		node->magic = EXTENT_MAGIC;
+		node->count = 1;
+		node->depth = d;
+		node->entries[0] = *e;
+		if(d > 0){
+			node->entries[0].physical = below;
+			node->entries[0].length = 0;
+		}
+		if(cache_write_blocks(block,1,node) < 0){
+			block = NO_BLOCK;
+			break;
+		}
+	}
+	free(node);
+	return block;
+}
+
+//add an extent after the last one of a subtree, merging the two when they touch; 1 if the subtree is full
+int appendExtent(extent_t *entries, uint16_t *count, int capacity, int depth, const extent_t *e){
+	if(depth == 0){
+		extent_t *last = *count > 0 ? &entries[*count - 1] : NULL;
+		if(last != NULL && last->logical + last->length == e->logical && last->physical + last->length == e->physical){
+			last->length += e->length;
+			return 0;
+		}
+		if(*count == capacity){
+			return 1;
+		}
+		entries[(*count)++] = *e;
+		return 0;
+	}
+	if(*count == 0){
+		return -1;
+	}
+	//appends always go down the rightmost path
+	extent_node_t *node = alloc_blocks(1);
+	uint32_t child = entries[*count - 1].physical;
+	int result = -1;
+	if(cache_read_blocks(child,1,node) >= 0 && node->magic == EXTENT_MAGIC && node->depth == depth - 1){
+		result = appendExtent(node->entries,&node->count,extentsPerNode(),depth - 1,e);
+		if(result == 0 && cache_write_blocks(child,1,node) < 0){
+			result = -1;
+		}
+	}
+	free(node);
+	if(result == 1 && *count < capacity){
+		//the rightmost child is full, so a new branch beside it takes the extent
+		uint32_t branch = newBranch(depth - 1,e);
+		if(branch == NO_BLOCK){
+			return -1;
+		}
+		extent_t index = { e->logical, branch, 0 };
+		entries[(*count)++] = index;
+		return 0;
+	}
+	return result;
+}
+
+//record that file blocks [block, block+n), the first ones past those mapped, are stored from disk block physical on
+int appendBlocks(inode_t *inode, uint32_t block, uint32_t physical, uint32_t n){
+	if(inodeFormat == FORMAT_POINTERS){
+		return appendPointers(inode,block,physical,n);
+	}
+	extent_t e = { block, physical, n };
+	int result = appendExtent(inode->extents,&inode->extentCount,INLINE_EXTENTS,inode->extentDepth,&e);
+	if(result != 1){
+		return result;
+	}
+	//the root in the inode is full: its entries move to a node of their own and the tree grows a level
+	if(free_block_count() < (uint32_t)inode->extentDepth + 2){
+		return -1;
+	}
+	uint32_t moved = get_index();
+	extent_node_t *node = alloc_blocks(1);
+	node->magic = EXTENT_MAGIC;
+	node->count = inode->extentCount;
+	node->depth = inode->extentDepth;
+	memcpy(node->entries,inode->extents,inode->extentCount*sizeof(extent_t));
+	int written = cache_write_blocks(moved,1,node);
+	free(node);
+	uint32_t branch = newBranch(inode->extentDepth,&e);
+	if(written < 0 || branch == NO_BLOCK){
+		return -1;
+	}
+	extent_t left = { inode->extents[0].logical, moved, 0 };
+	extent_t right = { block, branch, 0 };
+	memset(inode->extents,0,sizeof(inode->extents));
+	inode->extents[0] = left;
+	inode->extents[1] = right;
+	inode->extentCount = 2;
+	inode->extentDepth++;
+	return 0;
+}
+
+int collectExtents(const extent_t *entries, int count, int depth, unsigned int *blocks, int n){
+	extent_node_t *node = depth > 0 ? alloc_blocks(1) : NULL;
+	for(int i=0;i<count;i++){
+		if(depth == 0){
+			for(uint32_t j=0;j<entries[i].length && n < number_of_blocks;j++){
+				blocks[n++] = entries[i].physical + j;
+			}
+			continue;
+		}
+		if(cache_read_blocks(entries[i].physical,1,node) >= 0 && node->magic == EXTENT_MAGIC && node->depth == depth - 1){
+			n = collectExtents(node->entries,node->count,depth - 1,blocks,n);
+		}
+		if(n < number_of_blocks){
+			blocks[n++] = entries[i].physical;
+		}
+	}
+	free(node);
+	return n;
+}
+
+//list every disk block a file uses, its mapping blocks included; blocks has room for number_of_blocks entries
+int collectBlocks(inode_t *inode, unsigned int *blocks){
+	if(inodeFormat == FORMAT_EXTENTS){
+		return collectExtents(inode->extents,inode->extentCount,inode->extentDepth,blocks,0);
+	}
+	int n = 0;
+	int blocksUsed = calculateNumberOfBlocksNeeded(inode->size);
+	for(int i=0;i<12 && i<blocksUsed;i++){
+		blocks[n++] = inode->data_ptrs[i];
+	}
+	if(inode->indirectPointer != -1){
+		unsigned int *indirectTable = alloc_blocks(1);
+		if(cache_read_blocks(inode->indirectPointer,1,indirectTable) >= 0){
+			for(int i=12;i<blocksUsed && i<12+pointers_per_block;i++){
+				blocks[n++] = indirectTable[i-12];
+			}
+		}
+		free(indirectTable);
+		blocks[n++] = inode->indirectPointer;
+	}
+	return n;
+}
+
+//hand out the next block of a write's run of contiguous blocks, taking a new run of up to want blocks near goal once it is used up
+uint32_t nextRunBlock(uint32_t goal, uint32_t want, uint32_t *runNext, uint32_t *runLeft){
+	if(*runLeft == 0){
+		*runNext = get_extent(goal,want,runLeft);
+		if(*runNext == BITMAP_FULL){
+			return BITMAP_FULL;
+		}
+	}
+	(*runLeft)--;
+	return (*runNext)++;
+}
+
 /*********************************************************************************
 *								Helper Methods
 **********************************************************************************/
@@ -162,6 +1051,9 @@ int validateFileName(char *input){
 }
 //find file inode given filename
 int findFileInode(char *filename){
+	if(loadDirectory() < 0){
+		return -1;
+	}
 	for(int i=0; i<max_inode_number;i++){
 		if(strcmp(rootDirectory[i].name,filename) == 0){
 			return rootDirectory[i].num;
@@ -183,6 +1075,9 @@ int findNextFreeFileDescriptor(){
 
 //find next available root directory slot
 int findNextFreeFileSlot(){
+	if(loadDirectory() < 0){
+		return -1;
+	}
 	for(int i=0; i<max_inode_number; i++){
 		if(rootDirectory[i].num == -1){
 			return i;
@@ -195,6 +1090,9 @@ int findNextFreeFileSlot(){
 
 //find next available inode, return -1 if no more slots in table
 int findNextFreeInode(){
+	if(loadInodeTable() < 0){
+		return -1;
+	}
 	for(int i=0; i<max_inode_number; i++){
 		if(inodeTable[i].size == -1){
 			return i;
@@ -203,6 +1101,92 @@ int findNextFreeInode(){
 	return -1;
 }
 
+//image file(s) backing the file system; SFS_DISK_IMAGES can name a comma separated list to stripe over
+char *diskImages(){
+	char *images = getenv("SFS_DISK_IMAGES");
+	if(images == NULL || images[0] == '\0'){
+		return diskName;
+	}
+	return images;
+}
+
+int compareBlocks(const void *a, const void *b){
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+	return (x > y) - (x < y);
+}
+
+//discard freed data blocks on the disk, one call per contiguous run
+void discardBlocks(unsigned int *blocks, int n){
+	if(n < 1){
+		return;
+	}
+	qsort(blocks,n,sizeof(unsigned int),compareBlocks);
+	int runStart = 0;
+	for(int i=1;i<=n;i++){
+		if(i == n || blocks[i] != blocks[i-1] + 1){
+			cache_discard_blocks(blocks[runStart],i - runStart);
+			runStart = i;
+		}
+	}
+}
+
+//prefetch the blocks that follow a sequential read, growing the window as the stream continues
+void readAhead(int fileID, int bytesToRead){
+	file_descriptor *fd = &fileDescriptorTable[fileID];
+	inode_t *inode = &inodeTable[fd->inodeIndex];
+	uint64_t start = fd->rwptr;
+
+	//a read that picks up where the last one ended, or starts the file, continues a stream
+	if(start != fd->raLast && start != 0){
+		fd->raWindow = 0;
+		fd->raEnd = 0;
+		return;
+	}
+	fd->raWindow = fd->raWindow == 0 ? READAHEAD_MIN : fd->raWindow * 2;
+	if(fd->raWindow > READAHEAD_MAX){
+		fd->raWindow = READAHEAD_MAX;
+	}
+
+	uint64_t next = (start + bytesToRead + block_size - 1) / block_size;
+	uint64_t end = next + fd->raWindow;
+	uint64_t fileBlocks = (inode->size + block_size - 1) / block_size;
+	if(end > fileBlocks){
+		end = fileBlocks;
+	}
+	if(fd->raEnd > next){
+		next = fd->raEnd;
+	}
+
+	int blocks[READAHEAD_MAX + 1];
+	int n = 0;
+	uint64_t i = next;
+	while(i < end){
+		uint32_t run;
+		uint32_t missing = NO_BLOCK;
+		uint32_t physical = mapBlock(inode,i,&run,&missing,fd);
+		//a mapping block not cached yet is fetched first, and the data it maps on a later read
+		if(physical == NO_BLOCK){
+			if(missing != NO_BLOCK){
+				blocks[n++] = missing;
+			}
+			end = i;
+			break;
+		}
+		for(uint32_t j=0;j<run && i<end;j++,i++){
+			blocks[n++] = physical + j;
+		}
+	}
+	//continue next time from the first block the cache did not take
+	int handled = n > 0 ? cache_prefetch(blocks,n) : 0;
+	if(handled < n){
+		end = next + handled;
+	}
+	if(end > fd->raEnd){
+		fd->raEnd = end;
+	}
+}
+
 int checkIfFileOpen(char *name){
 	int inode = findFileInode(name);
 	if(inode == -1){
@@ -219,21 +1203,50 @@ int checkIfFileOpen(char *name){
 /*********************************************************************************
 *									API methods
 **********************************************************************************/
-void mksfs(int fresh) {
+void set_sfs_geometry(const sfs_geometry *geometry){
+	sfs_geometry none = { 0, 0, 0 };
+	formatGeometry = geometry != NULL ? *geometry : none;
+}
+
+void mountFileSystem(int fresh) {
 	printf("Creating Simple File System\n");
-	//initialize file descriptor table
-	init_fdt();
+	//changes still gathering for the previous file system go to its disk first
+	if(commitOps > 0){
+		commitMetadata();
+	}
+	commitMaxOps = envSetting("SFS_COMMIT_OPS",COMMIT_MAX_OPS);
+	commitMaxMs = envSetting("SFS_COMMIT_MS",COMMIT_MAX_MS);
+	commitOps = 0;
+	pendingDiscardCount = 0;
+	mounted = FALSE;
 	//if fresh file system
 	if(fresh == 1){
-		//remove previous filesystem and initialize fresh disk
+		//lay the disk out for the requested geometry and size the tables for it
+		init_super(formatGeometry.block_size > 0 ? formatGeometry.block_size : envSetting("SFS_BLOCK_SIZE",DEFAULT_BLOCK_SIZE),
+			formatGeometry.blocks > 0 ? formatGeometry.blocks : envSetting("SFS_NUM_BLOCKS",DEFAULT_NUM_BLOCKS),
+			formatGeometry.inodes > 0 ? formatGeometry.inodes : envSetting("SFS_NUM_INODES",DEFAULT_NUM_INODES));
+		if(useGeometry(superblock) < 0){
+			printf("Invalid file system geometry\n");
+			return;
+		}
+		//initialize file descriptor table
+		init_fdt();
+		//remove previous filesystem and initialize fresh disk; the tables are built in memory, so all of them count as loaded
+		memset(metadataState,METADATA_LOADED,metadata_blocks);
 		init_int();
-		init_super();
 		init_root();
-		remove(diskName);
-		init_fresh_disk(diskName,BLOCK_SIZE,number_of_blocks);
+		//write back the previous file system's cached blocks before its disk goes away
+		close_cache();
+		//a stripe set named by SFS_DISK_IMAGES is truncated member by member, and the default image is left alone
+		if(diskImages() == diskName){
+			remove(diskName);
+		}
+		init_fresh_disk(diskImages(),block_size,number_of_blocks);
+		init_cache(block_size,0);
 
-		temp = calloc(1,calculateSizeNeeded(sizeof(superblock_t)));
-		count = write_blocks(superblock_index,1,temp);
+		temp = alloc_blocks(calculateNumberOfBlocksNeeded(sizeof(superblock_t)));
+		memcpy(temp,superblock,sizeof(superblock_t));
+		count = cache_write_blocks(superblock_index,1,temp);
 		if(count < 0){
 			printf("Error writing superblock\n");
 			return;
@@ -248,14 +1261,21 @@ void mksfs(int fresh) {
 
 		//initialize inode table
 		init_int();
-		inodeTable[0].size = sizeof(rootDirectory);
-		inodeTable[0].data_ptrs[0] = root_directory_index;
-		inodeTable[0].data_ptrs[1] = root_directory_index + 1;
-		inodeTable[0].data_ptrs[2] = root_directory_index + 2;
+		inodeTable[0].size = ROOT_DIRECTORY_BYTES;
+		if(inodeFormat == FORMAT_EXTENTS){
+			extent_t directory = { 0, root_directory_index, calculateNumberOfBlocksNeeded(ROOT_DIRECTORY_BYTES) };
+			inodeTable[0].extents[0] = directory;
+			inodeTable[0].extentCount = 1;
+		}
+		else{
+			for(int i=0;i<12 && i<calculateNumberOfBlocksNeeded(ROOT_DIRECTORY_BYTES);i++){
+				inodeTable[0].data_ptrs[i] = root_directory_index + i;
+			}
+		}
 		//create temporary buffer which will be used to write to disk
-		temp = calloc(1,calculateSizeNeeded(sizeof(inodeTable)));
-		memcpy(temp,inodeTable,sizeof(inodeTable));
-		count = write_blocks(inode_table_index,calculateNumberOfBlocksNeeded(sizeof(inodeTable)),temp);
+		temp = alloc_blocks(calculateNumberOfBlocksNeeded(INODE_TABLE_BYTES));
+		memcpy(temp,inodeTable,INODE_TABLE_BYTES);
+		count = cache_write_blocks(inode_table_index,calculateNumberOfBlocksNeeded(INODE_TABLE_BYTES),temp);
 		if(count < 0){
 			printf("Error writing inode table\n");
 			return;
@@ -267,9 +1287,9 @@ void mksfs(int fresh) {
 
 		//initialize directory table
 		//create temporary buffer which will be used to write to disk
-		temp = calloc(1,calculateSizeNeeded(sizeof(rootDirectory)));
-		memcpy(temp,rootDirectory,sizeof(rootDirectory));
-		count = write_blocks(root_directory_index,calculateNumberOfBlocksNeeded(sizeof(rootDirectory)),temp);
+		temp = alloc_blocks(calculateNumberOfBlocksNeeded(ROOT_DIRECTORY_BYTES));
+		memcpy(temp,rootDirectory,ROOT_DIRECTORY_BYTES);
+		count = cache_write_blocks(root_directory_index,calculateNumberOfBlocksNeeded(ROOT_DIRECTORY_BYTES),temp);
 		if(count < 0){
 			printf("Error writing directory table\n");
 			return;
@@ -282,15 +1302,15 @@ void mksfs(int fresh) {
 		fileDescriptorTable[0].inodeIndex = 0;
 		fileDescriptorTable[0].inode = &inodeTable[0];
 
-		//initialize bitmap, with first 13 bits allocated to superblock,inode table,directory table and bitmap itself
+		//initialize bitmap, with the blocks before data_block_index allocated to superblock,inode table,directory table,bitmap and journal
 		for(uint32_t i=0; i<data_block_index; i++){
 			force_set_index(i);
 		}
 
 		//flush bitmap to disk
-		temp = calloc(1,calculateSizeNeeded(sizeof(free_bit_map)));
-		memcpy(temp,free_bit_map,sizeof(free_bit_map));
-		count = write_blocks(bitmap_index,calculateNumberOfBlocksNeeded(sizeof(free_bit_map)),temp);
+		temp = alloc_blocks(calculateNumberOfBlocksNeeded(BITMAP_BYTES));
+		memcpy(temp,free_bit_map,BITMAP_BYTES);
+		count = cache_write_blocks(bitmap_index,calculateNumberOfBlocksNeeded(BITMAP_BYTES),temp);
 		if(count < 0){
 			printf("Error writing bitmap\n");
 			return;
@@ -299,68 +1319,94 @@ void mksfs(int fresh) {
 			free(temp);
 			temp = NULL;
 		}
+		//start an empty journal behind the bitmap
+		if(journalFormat() < 0){
+			printf("Error writing journal\n");
+			return;
+		}
+		//the whole tables were just written
+		clearMetadata(METADATA_DIRTY);
+		//a freshly formatted disk is made durable before it is used
+		cache_flush();
+		sync_disk();
 	}
 	//if file system not fresh
 	else{
-		init_disk(diskName,BLOCK_SIZE,number_of_blocks);
-
-		//read superblock
-		temp = calloc(1,calculateSizeNeeded(sizeof(superblock_t)));
+		close_cache();
+		//the superblock says how the disk is laid out; it fits in the smallest block size
+		if(init_disk(diskImages(),MIN_BLOCK_SIZE,1) < 0){
+			return;
+		}
+		temp = alloc_blocks(1);
 		int count = read_blocks(superblock_index,1,temp);
 		if(count < 0){
 			printf("Error reading superblock\n");
 			return;
 		}
+		if(superblock == NULL){
+			superblock = calloc(1, sizeof(superblock_t));
+		}
 		memcpy(superblock,temp,sizeof(superblock_t));
 		if(temp != NULL){
 			free(temp);
 			temp = NULL;
 		}
-
-		//read inode table
-		temp = calloc(1,calculateSizeNeeded(sizeof(inodeTable)));
-		count = read_blocks(inode_table_index,calculateNumberOfBlocksNeeded(sizeof(inodeTable)),temp);
-		if(count < 0){
-			printf("Error reading inode table\n");
+		if(superblock->magic != SFS_MAGIC){
+			//images formatted before the superblock was written have the default geometry and no journal
+			superblock->block_size = DEFAULT_BLOCK_SIZE;
+			superblock->fs_size = DEFAULT_NUM_BLOCKS;
+			superblock->inode_table_len = DEFAULT_NUM_INODES;
+			superblock->format = FORMAT_POINTERS;
+			layoutSuperblock(superblock,0);
+		}
+		else if(superblock->data_block_index == 0){
+			//journaled images from before the region offsets were recorded use the default journal length
+			layoutSuperblock(superblock,DEFAULT_JOURNAL_BLOCKS);
+		}
+		if(useGeometry(superblock) < 0){
+			printf("Invalid superblock\n");
 			return;
 		}
-		memcpy(inodeTable,temp,sizeof(inodeTable));
+		//initialize file descriptor table
+		init_fdt();
+		init_disk(diskImages(),block_size,number_of_blocks);
+		init_cache(block_size,0);
+
+		//read the head of the image, superblock through journal header, with one request while it is small;
+		//the tables stay in the cache and are copied into memory a block at a time on first use
+		int headBlocks = journal_index + 1 < MOUNT_HEAD_BLOCKS ? journal_index + 1 : MOUNT_HEAD_BLOCKS;
+		temp = alloc_blocks(headBlocks);
+		count = cache_read_blocks(superblock_index,headBlocks,temp);
 		if(temp != NULL){
 			free(temp);
 			temp = NULL;
 		}
-
-		//read root directory table
-		temp = calloc(1,calculateSizeNeeded(sizeof(rootDirectory)));
-		count = read_blocks(root_directory_index,calculateNumberOfBlocksNeeded(sizeof(rootDirectory)),temp);
 		if(count < 0){
-			printf("Error reading root directory table\n");
+			printf("Error reading superblock\n");
 			return;
 		}
-		memcpy(rootDirectory,temp,sizeof(rootDirectory));
-		if(temp != NULL){
-			free(temp);
-			temp = NULL;
+
+		//finish what the journal committed before the tables are loaded; older images have no journal
+		journalEnabled = FALSE;
+		if(superblock->magic == SFS_MAGIC && journalReplay() < 0){
+			printf("Error replaying journal\n");
 		}
 
-		//read bitmap 
-		temp = calloc(1,calculateSizeNeeded(sizeof(free_bit_map)));
-		count = read_blocks(bitmap_index,calculateNumberOfBlocksNeeded(sizeof(free_bit_map)),temp);
-		if(count < 0){
-			printf("Error reading free bitmap\n");
+		//file descriptor 0 describes the root directory
+		if(loadInode(0) < 0){
+			printf("Error reading inode table\n");
 			return;
 		}
-		memcpy(free_bit_map,temp,sizeof(free_bit_map));
-		if(temp != NULL){
-			free(temp);
-			temp = NULL;
-		}
 		fileDescriptorTable[0].inodeIndex = 0;
 		fileDescriptorTable[0].inode = &inodeTable[0];
 	}
+	mounted = TRUE;
 }
 
-int sfs_getnextfilename(char *fname){
+int nextFileName(char *fname){
+	if(loadDirectory() < 0){
+		return -1;
+	}
 	while(1){
 		if(rootDirectory[nextFileCounter].num != -1){
 			// probably wrong line of code here
@@ -370,7 +1416,7 @@ int sfs_getnextfilename(char *fname){
 		else{
 			nextFileCounter++;
 		}
-		if(nextFileCounter == 100){
+		if(nextFileCounter == max_inode_number){
 				nextFileCounter = 0;
 				return 0;
 		}
@@ -378,14 +1424,14 @@ int sfs_getnextfilename(char *fname){
 	}
 }
 
-int sfs_getfilesize(const char* path){
+int fileSize(const char* path){
 	//validate file name
 	if(validateFileName(path) == FALSE){
 		return -1;
 	}
 	//if file exists, return file size obtained from inode
 	int inodeNumber = findFileInode(path);
-	if(inodeNumber != -1){
+	if(inodeNumber != -1 && loadInode(inodeNumber) == 0){
 		return inodeTable[inodeNumber].size;
 	}
 	//file doesn't exist, return -1 for error
@@ -393,7 +1439,7 @@ int sfs_getfilesize(const char* path){
 		return -1;
 	}
 }
-int sfs_fopen(char *name){
+int openFile(char *name){
 	//check to see if valid file name
 	if(validateFileName(name) == FALSE){
 		// printf("invalid file name %s; can't be opened\n",name);
@@ -401,6 +1447,9 @@ int sfs_fopen(char *name){
 	}
 	//check to see if file exists
 	int inodeNumber = findFileInode(name);
+	if(inodeNumber != -1 && loadInode(inodeNumber) < 0){
+		return -1;
+	}
 
 	//If file is already open, just set rwptr to size of file and return
 	int fdIndex = checkIfFileOpen(name); 
@@ -434,56 +1483,38 @@ int sfs_fopen(char *name){
 		rootDirectory[rootID].num = inodeNumber;
 		inodeTable[inodeNumber].size = 0;
 
-		//write updated root directory and inode table to disk
-		temp = calloc(1,calculateSizeNeeded(sizeof(inodeTable)));
-		memcpy(temp,rootDirectory,sizeof(inodeTable));
-		count = write_blocks(inode_table_index,calculateNumberOfBlocksNeeded(sizeof(inodeTable)),temp);
-		if(count < 0){
-			printf("Error writing inode table\n");
-			// return;
-		}
-
-		if(temp != NULL){
-			free(temp);
-			temp = NULL;
-		}
-
-		temp = calloc(1,calculateSizeNeeded(sizeof(rootDirectory)));
-		memcpy(temp,rootDirectory,sizeof(rootDirectory));
-		count = write_blocks(root_directory_index,calculateNumberOfBlocksNeeded(sizeof(rootDirectory)),temp);
-		if(count < 0){
-			// printf("Error writing root directory\n");
+		//the new directory entry and inode go to disk with the next group commit
+		markDirectoryEntryDirty(rootID);
+		markInodeDirty(inodeNumber);
+		if(endOperation() < 0){
 			return -1;
 		}
-		if(temp != NULL){
-			free(temp);
-			temp = NULL;
-		}
 	}
 	fileDescriptorTable[nextFileID].inodeIndex = inodeNumber;
 	fileDescriptorTable[nextFileID].inode = &inodeTable[inodeNumber];
 	fileDescriptorTable[nextFileID].rwptr = inodeTable[inodeNumber].size;
+	fileDescriptorTable[nextFileID].raLast = fileDescriptorTable[nextFileID].rwptr;
+	fileDescriptorTable[nextFileID].raEnd = 0;
+	fileDescriptorTable[nextFileID].raWindow = 0;
+	releaseMapping(&fileDescriptorTable[nextFileID]);
 	return nextFileID;
 
 }
-int sfs_fclose(int fileID) {
-	if(fileDescriptorTable[fileID].inodeIndex == -1 || fileID > 99 || fileID < 0){
+int closeFile(int fileID) {
+	if(fileID >= max_inode_number || fileID < 0 || fileDescriptorTable[fileID].inodeIndex == -1){
 		return -1;
 	}
 	else{
 		fileDescriptorTable[fileID].inodeIndex = -1;
+		releaseMapping(&fileDescriptorTable[fileID]);
 	}
 	return 0;
 }
 
-int sfs_fread(int fileID, char *buf, int length) {
+int readFile(int fileID, char *buf, int length) {
 	int bytesRead = 0;
 	int bytesToRead = length;
 	int inodeInd = fileDescriptorTable[fileID].inodeIndex;
-	int indirectTable[256]; 
-	for(int i=0;i<256;i++){
-		indirectTable[i] = 0;
-	}
 	if(inodeInd == -1){
 		// printf("File with fileID %i is not open, can't read\n",fileID);
 		return -1;
@@ -496,236 +1527,204 @@ int sfs_fread(int fileID, char *buf, int length) {
  	if(fileDescriptorTable[fileID].rwptr + length > inodeTable[inodeInd].size){
  		bytesToRead = inodeTable[inodeInd].size - fileDescriptorTable[fileID].rwptr;
  	}
+	//start reading what comes next while this read is served
+	readAhead(fileID,bytesToRead);
 	while(bytesToRead > 0){
 		int currentReadLength = 0;
-		int dataPointerIndex = fileDescriptorTable[fileID].rwptr/BLOCK_SIZE;
-		//if we only need to read from direct data pointer block currently
-		if(dataPointerIndex < 12){
-			temp = calloc(1,BLOCK_SIZE);
-			count = read_blocks(inodeTable[inodeInd].data_ptrs[dataPointerIndex],1,temp);
+		int offset = fileDescriptorTable[fileID].rwptr % block_size;
+		uint32_t run;
+		uint32_t block = mapBlock(&inodeTable[inodeInd],fileDescriptorTable[fileID].rwptr/block_size,&run,NULL,&fileDescriptorTable[fileID]);
+		if(block == NO_BLOCK){
+			// printf("Error mapping data block\n");
+			return -1;
+		}
+		//whole blocks that follow each other on disk are read with one call straight into buf
+		if(offset == 0 && bytesToRead >= block_size){
+			uint32_t n = bytesToRead/block_size;
+			if(n > run){
+				n = run;
+			}
+			count = cache_read_blocks(block,n,buf + bytesRead);
 			if(count < 0){
 				// printf("Error reading data\n");
 				return -1;
 			}
-			
-			//append available data from current block to buffer based on number of bytes read, and current rwptr in current block
-			currentReadLength = BLOCK_SIZE - (fileDescriptorTable[fileID].rwptr % BLOCK_SIZE);
-			if(currentReadLength > bytesToRead){
-				currentReadLength = bytesToRead;
-			}
-			memcpy(buf + bytesRead,temp + (fileDescriptorTable[fileID].rwptr % BLOCK_SIZE),currentReadLength);
-			if(temp != NULL){
-				free(temp);
-				temp = NULL;
-			}
-			//increment rwptr and update temp variables
-			fileDescriptorTable[fileID].rwptr += currentReadLength;
-			bytesToRead -= currentReadLength;
-			bytesRead += currentReadLength;	
-			dataPointerIndex++;	
+			currentReadLength = n*block_size;
 		}
-		//if we need to read from indirect pointer block
+		//a block read only in part goes through a buffer of its own
 		else{
-			//read indirect pointer block into stack
-			temp = calloc(1,sizeof(indirectTable));
-			count = read_blocks(inodeTable[inodeInd].indirectPointer,1,temp);
+			temp = alloc_blocks(1);
+			count = cache_read_blocks(block,1,temp);
 			if(count < 0){
-				// printf("Error reading indirect pointer table\n");
-				return -1;
-			}
-			memcpy(indirectTable,temp,sizeof(indirectTable));
-			if(temp != NULL){
+				// printf("Error reading data\n");
 				free(temp);
 				temp = NULL;
-			}
-
-			//read data block pointed to by indirect table index,
-			temp = calloc(1,BLOCK_SIZE);
-			count = read_blocks(indirectTable[dataPointerIndex-12],1,temp);
-			if(count < 0){
-				// printf("Error reading indirect pointer data\n");
 				return -1;
 			}
-			currentReadLength = BLOCK_SIZE - (fileDescriptorTable[fileID].rwptr % BLOCK_SIZE);
+			//append available data from current block to buffer based on number of bytes read, and current rwptr in current block
+			currentReadLength = block_size - offset;
 			if(currentReadLength > bytesToRead){
 				currentReadLength = bytesToRead;
 			}
-			memcpy(buf + bytesRead,temp + (fileDescriptorTable[fileID].rwptr % BLOCK_SIZE),currentReadLength);
-			if(temp != NULL){
-				free(temp);
-				temp = NULL;
-			}
-
-			fileDescriptorTable[fileID].rwptr += currentReadLength;
-			bytesToRead -= currentReadLength;
-			bytesRead += currentReadLength;	
-			dataPointerIndex++;	
+			memcpy(buf + bytesRead,temp + offset,currentReadLength);
+			free(temp);
+			temp = NULL;
 		}
+		//increment rwptr and update temp variables
+		fileDescriptorTable[fileID].rwptr += currentReadLength;
+		bytesToRead -= currentReadLength;
+		bytesRead += currentReadLength;	
 	}
+	fileDescriptorTable[fileID].raLast = fileDescriptorTable[fileID].rwptr;
 	
 	return bytesRead;
 
 }
 
-int sfs_fwrite(int fileID, const char *buf, int length) {
+int writeFile(int fileID, const char *buf, int length) {
 	int bytesWritten = 0;
 	int bytesToWrite = length;
 	int inodeInd = fileDescriptorTable[fileID].inodeIndex;
-	int indirectTable[256];
-	for(int i=0;i<256;i++){
-		indirectTable[i] = 0;
-	}
 	if(inodeInd == -1){
 		// printf("File with fileID %i is not open,can't write\n",fileID);
 		return -1;
 	}
-	if(length < 1 || fileDescriptorTable[fileID].rwptr + length > (BLOCK_SIZE-13)*number_of_blocks){
+	//kept to tell whether the inode needs writing back
+	inode_t oldInode = inodeTable[inodeInd];
+	//a write stops early once the block map or the disk is full; a size of UINT32_MAX marks an
+	//unused inode, so a file stays below it
+	if(length < 1 || fileDescriptorTable[fileID].rwptr + length >= UINT32_MAX){
 		// printf("Invalid length specified\n");
 		return -1;
 	}	
 	
+	//new blocks come from runs sized to the rest of the write, placed after the file's last block
+	uint32_t runNext = 0;
+	uint32_t runLeft = 0;
+	inode_t *inode = &inodeTable[inodeInd];
 	while(bytesToWrite > 0){
-		int dataPointerIndex = fileDescriptorTable[fileID].rwptr/BLOCK_SIZE; 
+		uint32_t fileBlock = fileDescriptorTable[fileID].rwptr/block_size;
+		int offset = fileDescriptorTable[fileID].rwptr % block_size;
 		int currentWriteLength = 0;
-		//if we only need to write to direct data pointer block currently
-		if(dataPointerIndex < 12){
-			//if a new data block is needed, set direct pointer and set bitmap
-			if((dataPointerIndex+1) > calculateNumberOfBlocksNeeded(inodeTable[inodeInd].size)){
-				// printf("F1");
-				inodeTable[inodeInd].data_ptrs[dataPointerIndex] = get_index();
-			}
-			temp = calloc(1,BLOCK_SIZE);
-			count = read_blocks(inodeTable[inodeInd].data_ptrs[dataPointerIndex],1,temp);
-			if(count < 0){
-				// printf("Error reading data\n");
-				return -1;
+		uint32_t wholeBlocks = offset == 0 ? bytesToWrite/block_size : 0;
+		uint32_t run;
+		uint32_t block;
+		int fresh = FALSE;
+		//if new data blocks are needed, take them from the run and map them after the file's last block
+		if(fileBlock >= (uint32_t)calculateNumberOfBlocksNeeded(inode->size)){
+			if(fileBlock >= maxFileBlocks()){
+				// printf("File has no room for more blocks\n");
+				break;
 			}
-			//append available data from current block to buffer based on number of bytes read, and current rwptr in current block
-			currentWriteLength = BLOCK_SIZE - (fileDescriptorTable[fileID].rwptr % BLOCK_SIZE);
-			//if current write length > bytesToWrite, truncate currentWriteLength to bytesToWrite
-			if(currentWriteLength > bytesToWrite){
-				currentWriteLength = bytesToWrite;
+			uint32_t goal = data_block_index;
+			if(runLeft == 0 && fileBlock > 0){
+				uint32_t last = mapBlock(inode,fileBlock - 1,&run,NULL,&fileDescriptorTable[fileID]);
+				if(last != NO_BLOCK){
+					goal = last + 1;
+				}
 			}
-			//copy changed section of block to temp buffer and then flush to disk
-		
-			memcpy(temp + (fileDescriptorTable[fileID].rwptr % BLOCK_SIZE),buf + bytesWritten,currentWriteLength);
-			count = write_blocks(inodeTable[inodeInd].data_ptrs[dataPointerIndex],1,temp);
-			if(count < 0){
-				// printf("Error writing data\n");
-				return -1;
+			uint32_t want = calculateNumberOfBlocksNeeded(offset + bytesToWrite);
+			if(want > maxFileBlocks() - fileBlock){
+				want = maxFileBlocks() - fileBlock;
 			}
-			//increment rwptr and update variables 
-			fileDescriptorTable[fileID].rwptr += currentWriteLength;
-			//increase size of file in inode if rwptr is now greater than file size
-			if(fileDescriptorTable[fileID].rwptr > inodeTable[inodeInd].size){
-				inodeTable[inodeInd].size = fileDescriptorTable[fileID].rwptr;
+			block = nextRunBlock(goal,want,&runNext,&runLeft);
+			//blocks of removed files still waiting for their commit are free once it is made
+			if(block == BITMAP_FULL && pendingDiscardCount > 0 && commitMetadata() == 0){
+				block = nextRunBlock(goal,want,&runNext,&runLeft);
 			}
-			bytesToWrite -= currentWriteLength;
-			bytesWritten += currentWriteLength;	
-			dataPointerIndex++;	
-			free(temp);
-		}
-		//if we must write to indirect pointer currently
-		else{
-			if(dataPointerIndex > 267){
-				// printf("All indirect pointer blocks taken\n");
-				return bytesWritten;
+			if(block == BITMAP_FULL){
+				// printf("Disk full\n");
+				break;
 			}
-			//if indirect pointer not yet set, find free block for indirect pointer table and set in bitmap
-			if(inodeTable[inodeInd].indirectPointer == -1){
-				inodeTable[inodeInd].indirectPointer = get_index();
-
-				//initialize new indirect pointer table block
-				for(int i=0; i<256; i++){
-					indirectTable[i] = -1;
-				}
+			//the whole blocks to write take as much of the rest of the run as they need
+			run = 1;
+			while(run < wholeBlocks && runLeft > 0 && fileBlock + run < maxFileBlocks()){
+				runNext++;
+				runLeft--;
+				run++;
 			}
-			//else read from disk
-			else{
-				temp = calloc(1,BLOCK_SIZE);
-				count = read_blocks(inodeTable[inodeInd].indirectPointer,1,temp);
-				if(count < 0){
-					// printf("Error reading indirect pointer data\n");
+			if(appendBlocks(inode,fileBlock,block,run) < 0){
+				// printf("Disk full\n");
+				for(uint32_t i=0;i<run;i++){
+					rm_index(block + i);
 				}
-				memcpy(indirectTable,temp,256);
-				free(temp);
+				break;
 			}
-			//if a new indirect data block is needed, set indirect table to block index and set bitmap
-			if((dataPointerIndex+1) > calculateNumberOfBlocksNeeded(inodeTable[inodeInd].size)){
-				indirectTable[dataPointerIndex-12] = get_index();
+			//the kept indirect block or leaf may be the one just changed
+			releaseMapping(&fileDescriptorTable[fileID]);
+			fresh = TRUE;
+		}
+		else{
+			block = mapBlock(inode,fileBlock,&run,NULL,&fileDescriptorTable[fileID]);
+			if(block == NO_BLOCK){
+				// printf("Error mapping data block\n");
+				break;
 			}
-			 temp = calloc(1,BLOCK_SIZE);
-			count = read_blocks(indirectTable[dataPointerIndex-12],1,temp);
+		}
+		//whole blocks that follow each other on disk are written with one call straight from buf
+		if(wholeBlocks > 0){
+			uint32_t n = wholeBlocks < run ? wholeBlocks : run;
+			count = cache_write_blocks(block,n,(char *)buf + bytesWritten);
 			if(count < 0){
-				// printf("Error reading indirect pointer data\n");
+				// printf("Error writing data\n");
 				return -1;
 			}
-			//append available data from current block to buffer based on number of bytes read, and current rwptr in current block
-			currentWriteLength = BLOCK_SIZE - (fileDescriptorTable[fileID].rwptr % BLOCK_SIZE);
+			currentWriteLength = n*block_size;
+		}
+		//a block written only in part is merged with what it holds, which for a new block is nothing
+		else{
+			temp = alloc_blocks(1);
+			if(!fresh){
+				count = cache_read_blocks(block,1,temp);
+				if(count < 0){
+					// printf("Error reading data\n");
+					free(temp);
+					temp = NULL;
+					return -1;
+				}
+			}
+			currentWriteLength = block_size - offset;
 			//if current write length > bytesToWrite, truncate currentWriteLength to bytesToWrite
 			if(currentWriteLength > bytesToWrite){
 				currentWriteLength = bytesToWrite;
 			}
-
 			//copy changed section of block to temp buffer and then flush to disk
-			memcpy(temp + (fileDescriptorTable[fileID].rwptr % BLOCK_SIZE),buf + bytesWritten,currentWriteLength);
-			count = write_blocks(indirectTable[dataPointerIndex-12],1,temp);
-			if(count < 0){
-					// printf("Error writing indirect pointer data\n");
-					return -1;
-			}
-			//increment rwptr and update variables 
-			fileDescriptorTable[fileID].rwptr += currentWriteLength;
-			//increase size of file in inode if rwptr is now greater than file size
-			if(fileDescriptorTable[fileID].rwptr > inodeTable[inodeInd].size){
-				inodeTable[inodeInd].size = fileDescriptorTable[fileID].rwptr;
-			}
-			bytesToWrite -= currentWriteLength;
-			bytesWritten += currentWriteLength;	
-			dataPointerIndex++;	
-			if(temp != NULL){
-				free(temp);
-				temp = NULL;
-			}
-			//flush indirect pointer table to disk
-			count = write_blocks(inodeTable[inodeInd].indirectPointer,1,indirectTable);
+			memcpy(temp + offset,buf + bytesWritten,currentWriteLength);
+			count = cache_write_blocks(block,1,temp);
+			free(temp);
+			temp = NULL;
 			if(count < 0){
-				// printf("Error writing indirect table\n");
+				// printf("Error writing data\n");
 				return -1;
 			}
 		}
-
+		//increment rwptr and update variables 
+		fileDescriptorTable[fileID].rwptr += currentWriteLength;
+		//increase size of file in inode if rwptr is now greater than file size
+		if(fileDescriptorTable[fileID].rwptr > inode->size){
+			inode->size = fileDescriptorTable[fileID].rwptr;
+		}
+		bytesToWrite -= currentWriteLength;
+		bytesWritten += currentWriteLength;	
 	}
-	//flush memory data structures to disk including indirectTable if indirect pointers were used
-
-	//inode table
-	temp = calloc(1,calculateSizeNeeded(sizeof(inodeTable)));
-	memcpy(temp,inodeTable,sizeof(inodeTable));
-	count = write_blocks(inode_table_index,calculateNumberOfBlocksNeeded(sizeof(inodeTable)),temp);
-	if(count < 0){
-		// printf("Error writing inodeTable\n");
-		return -1;
+	//blocks of the run the write did not get to are free again
+	while(runLeft > 0){
+		rm_index(runNext++);
+		runLeft--;
 	}
-	if(temp != NULL){
-		free(temp);
-		temp = NULL;
+	//the inode and bitmap blocks that changed go with the next group commit; an overwrite inside the file changes neither
+	if(memcmp(&oldInode,&inodeTable[inodeInd],sizeof(inode_t)) != 0){
+		markInodeDirty(inodeInd);
 	}
-
-	//bitmap
-	temp = calloc(1,calculateSizeNeeded(sizeof(free_bit_map)));
-	memcpy(temp,free_bit_map,sizeof(free_bit_map));
-	count = write_blocks(bitmap_index,1,temp);
-	if(count < 0){
-		fprintf(stderr,"Error writing free bit map");
+	if(endOperation() < 0){
 		return -1;
 	}
-	free(temp);
 
 	return bytesWritten;
 }
 
 
-int sfs_fseek(int fileID, int loc) {
+int seekFile(int fileID, int loc) {
 	if(loc < 0){
 		// printf("Invalid location\n");
 		return -1;
@@ -744,67 +1743,196 @@ int sfs_fseek(int fileID, int loc) {
 	return 0;
 
 }
-int sfs_remove(char *file) {
+int removeFile(char *file) {
 	// remove in-memory data structures then flush to disk
 	int inodeNumber = findFileInode(file);
-	if(inodeNumber == -1){
+	if(inodeNumber == -1 || loadInode(inodeNumber) < 0){
 		// fprintf(stderr,"File %s, does not exist",file);
 		return -1;
 	}
-	for(int i=0;i<100;i++){
+	for(int i=0;i<max_inode_number;i++){
 		if(fileDescriptorTable[i].inodeIndex == inodeNumber){
-			sfs_fclose(i);
+			closeFile(i);
 			break;
 		}
 	}
-	inodeTable[inodeNumber].size = -1;
-	if(inodeTable[inodeNumber].indirectPointer != -1){
-		rm_index(inodeTable[inodeNumber].indirectPointer);
+	//collect the file's data blocks and the blocks that map them
+	unsigned int *freedBlocks = malloc(number_of_blocks * sizeof(unsigned int));
+	if(freedBlocks == NULL){
+		return -1;
 	}
-	inodeTable[inodeNumber].indirectPointer = -1;
-	for(int i=0;i<12;i++){
-		if(inodeTable[inodeNumber].indirectPointer != -1){
-			rm_index(inodeTable[inodeNumber].data_ptrs[i]);
+	int freedCount = collectBlocks(&inodeTable[inodeNumber],freedBlocks);
+	//they stay used until the commit frees them; never hand back a metadata or journal block through a stale pointer
+	int discardCount = 0;
+	for(int i=0;i<freedCount;i++){
+		if(freedBlocks[i] >= data_block_index && freedBlocks[i] < (unsigned int)number_of_blocks){
+			freedBlocks[discardCount++] = freedBlocks[i];
 		}
-		inodeTable[inodeNumber].data_ptrs[i] = -1;
 	}
+	init_inode(&inodeTable[inodeNumber]);
+	markInodeDirty(inodeNumber);
 	for(int i=0; i<max_inode_number;i++){
 		if(strcmp(rootDirectory[i].name,file) == 0){
 			rootDirectory[i].num = -1;
+			markDirectoryEntryDirty(i);
 			break;
 		}
 	}
 
-	//flush to disk
-	//inode table
-	temp = calloc(1,calculateSizeNeeded(sizeof(inodeTable)));
-	memcpy(temp,inodeTable,sizeof(inodeTable));
-	count = write_blocks(inode_table_index,calculateNumberOfBlocksNeeded(sizeof(inodeTable)),temp);
-	if(count < 0){
-		// printf("Error writing inodeTable\n");
+	//the freed blocks are released and punched out of the image by the commit that records them as free
+	if(pendingDiscardCount + discardCount > number_of_blocks && commitMetadata() < 0){
+		free(freedBlocks);
 		return -1;
 	}
-	free(temp);
+	for(int i=0;i<discardCount;i++){
+		pendingDiscards[pendingDiscardCount++] = freedBlocks[i];
+	}
+	free(freedBlocks);
+	if(endOperation() < 0){
+		return -1;
+	}
+	return 0;
+}
 
-	//bitmap
-	temp = calloc(1,calculateSizeNeeded(sizeof(free_bit_map)));
-	memcpy(temp,free_bit_map,sizeof(free_bit_map));
-	count = write_blocks(bitmap_index,1,temp);
-	if(count < 0){
-		// fprintf(stderr,"Error writing free bit map");
+int syncDisk() {
+	if(commitMetadata() < 0 || cache_flush() < 0){
 		return -1;
 	}
-	free(temp);
+	return sync_disk();
+}
 
-	//root directory
-	temp = calloc(1,calculateSizeNeeded(sizeof(rootDirectory)));
-	memcpy(temp,rootDirectory,sizeof(rootDirectory));
-	count = write_blocks(root_directory_index,calculateNumberOfBlocksNeeded(sizeof(rootDirectory)),temp);
-	if(count < 0){
-		// printf("Error writing directory table\n");
+int syncFile(int fileID) {
+	if(fileID < 0 || fileID >= max_inode_number || fileDescriptorTable[fileID].inodeIndex == -1){
 		return -1;
 	}
-	free(temp);
-	return 0;
+	//the whole image shares one device, so syncing a file syncs the disk
+	return syncDisk();
+}
+
+/*********************************************************************************
+*								Locked API entry points
+**********************************************************************************/
+//commit a transaction once it has been open for commitMaxMs, even if no further call comes to end it
+void *commitTimer(void *arg){
+	while(TRUE){
+		pthread_mutex_lock(&apiLock);
+		long long wait = commitMaxMs;
+		if(mounted && commitOps > 0){
+			long long open = nowMs() - commitStartMs;
+			if(open >= commitMaxMs){
+				commitMetadata();
+			}
+			else{
+				wait = commitMaxMs - open;
+			}
+		}
+		pthread_mutex_unlock(&apiLock);
+		struct timespec ts = { wait/1000, (wait%1000)*1000000 };
+		nanosleep(&ts,NULL);
+	}
+	return NULL;
+}
+
+//whatever is still gathering reaches the disk when the program ends normally
+void syncAtExit(){
+	pthread_mutex_lock(&apiLock);
+	if(mounted){
+		syncDisk();
+	}
+	pthread_mutex_unlock(&apiLock);
+}
+
+void initApi(){
+	//recursive, as some calls are made of others
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&apiLock,&attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_t thread;
+	if(pthread_create(&thread,NULL,commitTimer,NULL) == 0){
+		pthread_detach(thread);
+	}
+	atexit(syncAtExit);
+}
+
+void lockApi(){
+	pthread_once(&apiOnce,initApi);
+	pthread_mutex_lock(&apiLock);
+}
+
+void mksfs(int fresh) {
+	lockApi();
+	mountFileSystem(fresh);
+	pthread_mutex_unlock(&apiLock);
+}
+
+int sfs_getnextfilename(char *fname){
+	lockApi();
+	int result = nextFileName(fname);
+	pthread_mutex_unlock(&apiLock);
+	return result;
+}
+
+int sfs_getfilesize(const char* path){
+	lockApi();
+	int result = fileSize(path);
+	pthread_mutex_unlock(&apiLock);
+	return result;
+}
+
+int sfs_fopen(char *name){
+	lockApi();
+	int result = openFile(name);
+	pthread_mutex_unlock(&apiLock);
+	return result;
+}
+
+int sfs_fclose(int fileID) {
+	lockApi();
+	int result = closeFile(fileID);
+	pthread_mutex_unlock(&apiLock);
+	return result;
 }
 
+int sfs_fread(int fileID, char *buf, int length) {
+	lockApi();
+	int result = readFile(fileID,buf,length);
+	pthread_mutex_unlock(&apiLock);
+	return result;
+}
+
+int sfs_fwrite(int fileID, const char *buf, int length) {
+	lockApi();
+	int result = writeFile(fileID,buf,length);
+	pthread_mutex_unlock(&apiLock);
+	return result;
+}
+
+int sfs_fseek(int fileID, int loc) {
+	lockApi();
+	int result = seekFile(fileID,loc);
+	pthread_mutex_unlock(&apiLock);
+	return result;
+}
+
+int sfs_remove(char *file) {
+	lockApi();
+	int result = removeFile(file);
+	pthread_mutex_unlock(&apiLock);
+	return result;
+}
+
+int sfs_fsync(int fileID) {
+	lockApi();
+	int result = syncFile(fileID);
+	pthread_mutex_unlock(&apiLock);
+	return result;
+}
+
+int sfs_sync() {
+	lockApi();
+	int result = syncDisk();
+	pthread_mutex_unlock(&apiLock);
+	return result;
+}
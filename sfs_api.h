@@ -5,46 +5,123 @@
 
 #define MAX_FILE_NAME 21
 #define MAX_EXTENSION_NAME 3
-#define NUM_BLOCKS 1024  //maximum number of data blocks on the disk.
-#define BITMAP_ROW_SIZE (NUM_BLOCKS/8) // this essentially mimcs the number of rows we have in the bitmap. we will have 128 rows. 
-#define max_inode_number 100
-#define BLOCK_SIZE 1024
-#define number_of_blocks 1024
+// geometry mksfs(1) formats with unless set_sfs_geometry or the environment chooses another
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_NUM_BLOCKS 1024
+#define DEFAULT_NUM_INODES 100
+#define DEFAULT_JOURNAL_BLOCKS 64
+// block sizes a disk can be formatted with, powers of two
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+// the superblock and the inode table behind it are always at the start of the disk;
+// the other regions follow at offsets computed when formatting and kept in the superblock
 #define superblock_index 0
 #define inode_table_index 1
-// should be 3 blocks max (20 for name, 4 for inode number, *100 inodes)
-#define root_directory_index 9
-#define bitmap_index 12
-#define data_block_index 13
-#define SIZE 128
+// how inodes map file blocks, recorded in the superblock; disks without a recorded format use pointers
+#define FORMAT_POINTERS 1   // 12 direct pointers and a single indirect block
+#define FORMAT_EXTENTS 2    // extents in the inode, then a tree of extent nodes
+#define INLINE_EXTENTS 4
 
+/*
+ * Block 0. Holds the geometry the disk was formatted with: the block size,
+ * the number of blocks and inodes, and where each region starts. The inode
+ * table, root directory and bitmap are followed by the journal (a header
+ * block and a circular log) and then the data blocks. Disks formatted
+ * before the region offsets were recorded have them zero and use the
+ * layout of the default geometry, and those formatted before the inode
+ * format was recorded have it zero and use FORMAT_POINTERS.
+ */
 typedef struct superblock_t{
     uint64_t magic;
     uint64_t block_size;
     uint64_t fs_size;
     uint64_t inode_table_len;
     uint64_t root_dir_inode;
+    uint64_t root_directory_index;
+    uint64_t bitmap_index;
+    uint64_t journal_index;
+    uint64_t journal_blocks;
+    uint64_t data_block_index;
+    uint64_t format;
 } superblock_t;
 
+/*
+ * One journal block. The header (at journal_index) records where the oldest
+ * transaction not yet copied to its home locations starts and its sequence
+ * number. A transaction is a descriptor listing the home location of each
+ * logged block, copies of those blocks, and a commit block whose checksum
+ * covers them. home fills the rest of the block.
+ */
+typedef struct journal_block_t{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t sequence;
+    uint32_t start;
+    uint32_t count;
+    uint32_t checksum;
+    uint32_t home[];
+} journal_block_t;
+
+/*
+ * A run of file blocks stored one after another on disk. In an index
+ * entry of the extent tree, physical is the tree node mapping the file
+ * blocks from logical on, and length is 0.
+ */
+typedef struct extent_t {
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t length;
+} extent_t;
+
+/*
+ * One block of the extent tree. Nodes at depth 0 hold extents, the ones
+ * above hold index entries. Entries are sorted by logical block.
+ */
+typedef struct extent_node_t {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t depth;
+    extent_t entries[];
+} extent_node_t;
+
 typedef struct inode_t {
     unsigned int mode;
     unsigned int link_cnt;
     unsigned int uid;
     unsigned int gid;
     unsigned int size;
-    unsigned int data_ptrs[12];
-    unsigned int indirectPointer; // points to a data block that points to other data blocks (Single indirect)
+    union {
+        // FORMAT_POINTERS
+        struct {
+            unsigned int data_ptrs[12];
+            unsigned int indirectPointer; // points to a data block that points to other data blocks (Single indirect)
+        };
+        // FORMAT_EXTENTS: the root of the extent tree, holding extents while extentDepth is 0
+        struct {
+            uint16_t extentCount;
+            uint16_t extentDepth;
+            extent_t extents[INLINE_EXTENTS];
+        };
+    };
 } inode_t;
 
 /*
  * inodeIndex    which inode this entry describes
  * inode  pointer towards the inode in the inode table
  *rwptr    where in the file to start   
+ *raLast   where the previous read ended, to spot sequential reads
+ *raEnd    file block readahead has been started up to
+ *raWindow blocks kept read ahead, 0 while reads are not sequential
  */
 typedef struct file_descriptor {
     uint64_t inodeIndex;
     inode_t* inode; // 
     uint64_t rwptr;
+    uint64_t raLast;
+    uint64_t raEnd;
+    int raWindow;
+    uint32_t mapCached; // indirect block or extent leaf last used to map this file's blocks
+    void *mapData;      // a copy of it, so reads along the file skip the block cache
 } file_descriptor;
 
 
@@ -53,6 +130,22 @@ typedef struct directory_entry{
     char name[MAX_FILE_NAME]; // represents the name of the entry. 
 }directory_entry;
 
+/*
+ * Geometry for mksfs(1). A field left 0 takes SFS_BLOCK_SIZE, SFS_NUM_BLOCKS
+ * or SFS_NUM_INODES from the environment, or the default.
+ */
+typedef struct sfs_geometry{
+    int block_size;
+    int blocks;
+    int inodes;
+} sfs_geometry;
+
+void set_sfs_geometry(const sfs_geometry *geometry);
+/*
+ * Each call below holds one lock while it runs. Changes reach the disk in
+ * group commits: after SFS_COMMIT_OPS calls, once the oldest uncommitted
+ * change is SFS_COMMIT_MS old, on sfs_sync, and when the program exits.
+ */
 void mksfs(int fresh);
 int sfs_getnextfilename(char *fname);
 int sfs_getfilesize(const char* path);
@@ -62,5 +155,7 @@ int sfs_fread(int fileID, char *buf, int length);
 int sfs_fwrite(int fileID, const char *buf, int length);
 int sfs_fseek(int fileID, int loc);
 int sfs_remove(char *file);
+int sfs_fsync(int fileID);
+int sfs_sync();
 
 #endif //_INCLUDE_SFS_API_H_
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+/* Crash and replay test for the journal. sfs_sync commits to the log
+ * and leaves the copy to the home locations for a later checkpoint, so
+ * remounting right after it sees the disk as a crash would leave it:
+ * the tables on disk are old and only the log has the changes.
+ */
+
+/* Files written in each round of the replay tests.
+ */
+#define NUM_FILES 10
+
+/* Rounds of commit and remount; each moves the log on by a few blocks,
+ * so the transactions go around the circular log several times.
+ */
+#define NUM_ROUNDS 60
+
+/* Files created in one transaction by the oversized test. They dirty
+ * more inode table and directory blocks than the log has room for, so
+ * the transaction is written straight to the home locations.
+ */
+#define NUM_BIG_FILES 1000
+
+/* The journal block type sfs_api.c starts a transaction with.
+ */
+#define JOURNAL_DESCRIPTOR 2
+
+static char *block;
+
+/* pending() - whether the log holds a committed transaction that has
+ * not been copied to the home locations yet. It is read straight from
+ * the disk, below the file system.
+ */
+static int pending()
+{
+  superblock_t sb;
+  journal_block_t header;
+  journal_block_t *log = (journal_block_t *)block;
+
+  if (read_blocks(0, 1, block) < 0) {
+    return -1;
+  }
+  memcpy(&sb, block, sizeof(sb));
+  if (read_blocks(sb.journal_index, 1, block) < 0) {
+    return -1;
+  }
+  memcpy(&header, block, sizeof(header));
+  if (read_blocks(sb.journal_index + header.start, 1, block) < 0) {
+    return -1;
+  }
+  return log->magic == header.magic && log->type == JOURNAL_DESCRIPTOR
+    && log->sequence == header.sequence;
+}
+
+/* write_file() - create or replace a file holding the given text.
+ */
+static int write_file(char *name, const char *text)
+{
+  int fd = sfs_fopen(name);
+  int written;
+
+  if (fd < 0) {
+    return -1;
+  }
+  sfs_fseek(fd, 0);
+  written = sfs_fwrite(fd, text, strlen(text));
+  sfs_fclose(fd);
+  return written == (int)strlen(text) ? 0 : -1;
+}
+
+/* check_file() - count an error unless the file holds exactly the text.
+ */
+static int check_file(char *name, const char *text)
+{
+  char buffer[64];
+  int fd, readsize;
+
+  if (sfs_getfilesize(name) != (int)strlen(text)) {
+    fprintf(stderr, "ERROR: %s has size %d, expected %d\n", name,
+            sfs_getfilesize(name), (int)strlen(text));
+    return 1;
+  }
+  fd = sfs_fopen(name);
+  sfs_fseek(fd, 0);
+  memset(buffer, 0, sizeof(buffer));
+  readsize = sfs_fread(fd, buffer, strlen(text));
+  sfs_fclose(fd);
+  if (readsize != (int)strlen(text) || strcmp(buffer, text) != 0) {
+    fprintf(stderr, "ERROR: %s holds \"%s\", expected \"%s\"\n", name, buffer, text);
+    return 1;
+  }
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  char name[MAX_FILE_NAME];
+  char text[64];
+  int i, round;
+  int last[NUM_FILES];          /* Round each file was last written in */
+  int error_count = 0;
+  sfs_geometry big = { 0, 4096, 2 * NUM_BIG_FILES };
+
+  if ((block = malloc(MAX_BLOCK_SIZE)) == NULL) {
+    fprintf(stderr, "ABORT: Out of memory!\n");
+    exit(-1);
+  }
+
+  /* Only sfs_sync commits, so each round is exactly one transaction.
+   */
+  setenv("SFS_COMMIT_OPS", "1000000", 1);
+  setenv("SFS_COMMIT_MS", "1000000", 1);
+
+  /* Commit, skip the checkpoint, remount: the files come back from the
+   * log alone.
+   */
+  mksfs(1);
+  for (i = 0; i < NUM_FILES; i++) {
+    sprintf(name, "replay%d.txt", i);
+    sprintf(text, "%s round 0", name);
+    last[i] = 0;
+    if (write_file(name, text) < 0) {
+      fprintf(stderr, "ERROR: writing %s\n", name);
+      error_count++;
+    }
+  }
+  sfs_sync();
+  if (pending() != 1) {
+    fprintf(stderr, "ERROR: the commit was checkpointed, nothing to replay\n");
+    error_count++;
+  }
+  mksfs(0);
+  /* with a write-back cache the new log header may not be on disk yet */
+  sfs_sync();
+  if (pending() != 0) {
+    fprintf(stderr, "ERROR: the log still holds the replayed transaction\n");
+    error_count++;
+  }
+  for (i = 0; i < NUM_FILES; i++) {
+    sprintf(name, "replay%d.txt", i);
+    sprintf(text, "%s round 0", name);
+    error_count += check_file(name, text);
+  }
+  printf("Replayed one transaction\n");
+
+  /* The same round after round, changing a few files and creating one
+   * each time, until the transactions have wrapped around the end of
+   * the log. Only the new file changes metadata, so that is what the
+   * log has to bring back.
+   */
+  for (round = 1; round <= NUM_ROUNDS; round++) {
+    sprintf(name, "round%d.txt", round);
+    if (write_file(name, name) < 0) {
+      fprintf(stderr, "ERROR: writing %s\n", name);
+      error_count++;
+    }
+    for (i = round % 3; i < NUM_FILES; i += 3) {
+      sprintf(name, "replay%d.txt", i);
+      sprintf(text, "%s round %d", name, round);
+      last[i] = round;
+      if (write_file(name, text) < 0) {
+        fprintf(stderr, "ERROR: writing %s\n", name);
+        error_count++;
+      }
+    }
+    sfs_sync();
+    if (pending() != 1) {
+      fprintf(stderr, "ERROR: round %d was checkpointed, nothing to replay\n", round);
+      error_count++;
+    }
+    mksfs(0);
+    for (i = 0; i < NUM_FILES; i++) {
+      sprintf(name, "replay%d.txt", i);
+      sprintf(text, "%s round %d", name, last[i]);
+      error_count += check_file(name, text);
+    }
+    for (i = 1; i <= round; i++) {
+      sprintf(name, "round%d.txt", i);
+      error_count += check_file(name, name);
+    }
+  }
+  printf("Replayed %d rounds around the log\n", NUM_ROUNDS);
+
+  /* A transaction too big for the log goes straight to the home
+   * locations, and still has to be there after a remount.
+   */
+  set_sfs_geometry(&big);
+  mksfs(1);
+  for (i = 0; i < NUM_BIG_FILES; i++) {
+    sprintf(name, "big%d.txt", i);
+    if (write_file(name, name) < 0) {
+      fprintf(stderr, "ERROR: writing %s\n", name);
+      error_count++;
+    }
+  }
+  sfs_sync();
+  if (pending() != 0) {
+    fprintf(stderr, "ERROR: the oversized transaction was logged\n");
+    error_count++;
+  }
+  mksfs(0);
+  for (i = 0; i < NUM_BIG_FILES; i++) {
+    sprintf(name, "big%d.txt", i);
+    error_count += check_file(name, name);
+  }
+  printf("Wrote %d files in one oversized transaction\n", NUM_BIG_FILES);
+
+  set_sfs_geometry(NULL);
+  free(block);
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
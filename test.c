@@ -3,8 +3,13 @@
 #include <assert.h>
 #include <stdio.h>
 
+// blocks in the bitmap under test
+#define TEST_BLOCKS 1024
+
 int main() {
 
+    assert(init_bitmap(TEST_BLOCKS) == 0);
+
     /*
      * Get 64 blocks.
      * Since everything is empty, we should
@@ -40,5 +45,57 @@ int main() {
         assert(get_index() == i);
     }
 
+    /*
+     * Ask for a run of 8 blocks after 10. The blocks
+     * up to 91 are taken, so the run is 92..99
+     */
+    uint32_t len;
+    assert(get_extent(10, 8, &len) == 92 && len == 8);
+
+    /*
+     * Free 40..42. A run of 8 right there does not
+     * exist, so the run starting at 100 is used...
+     */
+    for (int i=40; i < 43; i++) {
+        rm_index(i);
+    }
+    assert(get_extent(40, 8, &len) == 100 && len == 8);
+
+    /*
+     * ...but a run of 3 at 40 fits exactly
+     */
+    assert(get_extent(40, 3, &len) == 40 && len == 3);
+
+    /*
+     * Taken so far: 0..107. Only 1020..1023 are free
+     * after 1020, so the search wraps around to 108
+     */
+    assert(get_extent(1020, 8, &len) == 108 && len == 8);
+
+    /*
+     * Take everything else: the longest run, 116..1023
+     */
+    assert(get_extent(0, TEST_BLOCKS, &len) == 116 && len == 908);
+
+    /*
+     * With no run of 8 left, the longest run is taken
+     * instead, wherever it is
+     */
+    rm_index(200);
+    rm_index(201);
+    for (int i=300; i < 303; i++) {
+        rm_index(i);
+    }
+    rm_index(500);
+    assert(get_extent(0, 8, &len) == 300 && len == 3);
+    assert(get_extent(0, 8, &len) == 200 && len == 2);
+    assert(get_index() == 500);
+
+    /*
+     * The disk is full now
+     */
+    assert(get_index() == BITMAP_FULL);
+    assert(get_extent(0, 8, &len) == BITMAP_FULL && len == 0);
+
     printf("All tests passed!\n");
 }